@@ -1,146 +1,788 @@
 #include <iostream> // Include for input and output stream operations
 #include <iomanip> // For std::setw and std::left
 #include <fstream> // Include for file stream operations
-#include <complex> // Include for complex number operations
 #include <vector> // Include for using the vector container
 #include <cstdlib> // Include for standard library functions, like atoi (ASCII to integer) and atof (ASCII to float)
 #include <cmath> // Include for mathematical functions, like sqrt and sin
 #include <string> // Include for using the string class
+#include <cstddef> // Include for offsetof
+#include <cstdint> // Include for uint8_t
+#include <algorithm> // Include for std::min, std::copy and std::fill
+#include <cfloat> // Include for DBL_EPSILON
+#include <sstream> // Include for std::istringstream and std::ostringstream
+#include <future> // Include for std::async, which writes one frame while the next is computed
+#include <chrono> // Include for std::chrono::steady_clock, which times the phases for -stats
+#include <thread> // Include for std::thread::hardware_concurrency
 #include <mpi.h> // Include MPI header
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define MANDEL_X86_SIMD 1 // Build the AVX2/AVX-512 kernels; they are only used if CPUID reports support
+#include <immintrin.h> // Include for AVX2 and AVX-512 intrinsics
+#endif
+#ifdef _OPENMP
+#include <omp.h> // Include for OpenMP runtime functions (only when compiled with -fopenmp)
+#endif
+#if defined(MANDEL_OFFLOAD) && !defined(_OPENMP)
+#undef MANDEL_OFFLOAD // The offload backend is made of OpenMP target regions, so it needs -fopenmp as well
+#endif
 
 // Constants defining the output image size and anti-aliasing samples
-const int WIDTH = 1920; // Image width in pixels
-const int HEIGHT = 1080; // Image height in pixels
+const int WIDTH = 1920; // Default image width in pixels (-w)
+const int HEIGHT = 1080; // Default image height in pixels (-h)
+const size_t STRIP_BUDGET = 64 << 20; // Bytes the strip buffers of the bounded-memory output may take by default
+const size_t FRAME_BUDGET = (size_t)4 << 30; // Bytes of a P6 frame process 0 may gather; larger ones are streamed
+
+// Work-distribution modes for splitting the image rows across MPI processes
+enum SchedMode {
+    SCHED_STATIC = 0,  // Contiguous block of rows per process (original behaviour)
+    SCHED_CYCLIC = 1,  // Rows dealt out round-robin: row y goes to process y % size
+    SCHED_DYNAMIC = 2  // Process 0 hands out chunks of rows to workers on request
+};
+
+// Message tags used by the dynamic (master/worker) scheduler
+const int TAG_RESULT = 1; // Worker -> master: finished chunk (or initial work request)
+const int TAG_ASSIGN = 2; // Master -> worker: next chunk to compute (0 rows means stop)
+const int TAG_CHUNK = 16; // Stream mode: chunk k of the sender's rows has tag TAG_CHUNK + k
+const int STREAM_BUFFERS = 4; // Stream mode: chunks a process may have in flight to process 0
+
+// Escape-time kernels that can be selected with -kernel
+enum KernelType {
+    KERNEL_AUTO = 0,   // Widest SIMD kernel supported by the CPU
+    KERNEL_SCALAR = 1, // One sample at a time
+    KERNEL_AVX2 = 2,   // 4 samples in lockstep
+    KERNEL_AVX512 = 3  // 8 samples in lockstep
+};
+const char *kernelNames[] = {"auto", "scalar", "avx2", "avx512"}; // Names used by -kernel, indexed by KernelType
+
+// Two orbit points closer than this in both components are treated as the same point by cycle detection
+const double PERIOD_TOLERANCE = 1e-13;
+const float PERIOD_TOLERANCE_FLOAT = 1e-4f; // The same for single-precision orbits
+const double PERIOD_TOLERANCE_DD = 1e-28; // The same for double-double orbits
+
+// Scalar types the escape-time loop can run in, selected with -precision
+enum PrecisionType {
+    PRECISION_AUTO = 0,   // Double, or double-double for the tiles double cannot resolve, chosen per tile
+    PRECISION_FLOAT = 1,  // Single precision, twice the SIMD lanes of double; approximate, so only on request
+    PRECISION_DOUBLE = 2, // Double precision
+    PRECISION_DD = 3      // Double-double (about 32 digits), scalar only
+};
+const char *precisionNames[] = {"auto", "float", "double", "dd"}; // Names used by -precision, indexed by PrecisionType
+
+// Double-double number: the unevaluated sum hi + lo of two doubles, with about 106 significant bits
+struct DoubleDouble {
+    double hi, lo;
+    DoubleDouble() : hi(0.0), lo(0.0) {}
+    DoubleDouble(double x) : hi(x), lo(0.0) {}
+    DoubleDouble(double h, double l) : hi(h), lo(l) {}
+};
+
+// Output image formats that can be selected with -fmt
+enum ImageFormat {
+    FORMAT_P3 = 0, // ASCII PNM, one "r g b" line per pixel
+    FORMAT_P6 = 1  // Binary PNM, 3 bytes per pixel
+};
+
+// How the finished rows reach the output file, selected with -io
+enum IOMode {
+    IO_GATHER = 0, // Process 0 collects the whole image and writes it alone
+    IO_MPIIO = 1,  // Every process writes its own rows into the shared file (P6 only)
+    IO_STREAM = 2  // Processes send row chunks as they finish; process 0 writes them as they arrive
+};
+
+// Color schemes that can be selected with -palette
+enum PaletteType {
+    PALETTE_SINE = 0, // Original phase-shifted sine waves
+    PALETTE_FIRE = 1, // Black, red, yellow, white
+    PALETTE_ICE = 2,  // Dark blue, cyan, white
+    PALETTE_GRAY = 3  // Grayscale
+};
+const char *paletteNames[] = {"sine", "fire", "ice", "gray"}; // Names used by -palette, indexed by PaletteType
+
+// Rendering engines that can be selected with -engine
+enum EngineType {
+    ENGINE_BRUTE = 0, // Evaluate every sample
+    ENGINE_MS = 1     // Mariani-Silver: fill rectangles whose border has a single escape count
+};
+const char *engineNames[] = {"brute", "ms"}; // Names used by -engine, indexed by EngineType
+const int MS_MIN_SIDE = 4; // Rectangles this narrow are evaluated instead of subdivided
+const int MS_TASK_CELLS = 4096; // Rectangles with more cells than this subdivide into OpenMP tasks
+
+// Deep-zoom (perturbation) modes that can be selected with -deep
+enum DeepMode {
+    DEEP_AUTO = 0, // Use perturbation past DEEP_ZOOM, or where -precision auto would need double-double
+    DEEP_ON = 1,   // Always use perturbation
+    DEEP_OFF = 2   // Never use perturbation
+};
+const char *deepModeNames[] = {"auto", "on", "off"}; // Names used by -deep, indexed by DeepMode
+const double DEEP_ZOOM = 1e12; // Past this zoom, pixel spacing nears the precision of double coordinates
+
+// Anti-aliasing modes that can be selected with -aamode
+enum AAMode {
+    AA_FULL = 0,    // Every pixel takes all aaSamples samples
+    AA_ADAPTIVE = 1 // Only pixels on color edges are supersampled
+};
+const char *aaModeNames[] = {"full", "adaptive"}; // Names used by -aamode, indexed by AAMode
+
+// Coloring modes that can be selected with -coloring
+enum ColoringMode {
+    COLORING_ITER = 0,  // One palette entry per escape count, which shows as bands of equal color
+    COLORING_SMOOTH = 1 // Normalized iteration count from the |z|^2 each sample escaped with, without bands
+};
+const char *coloringNames[] = {"iter", "smooth"}; // Names used by -coloring, indexed by ColoringMode
+
+// Compute devices that can be selected with -device
+enum DeviceType {
+    DEVICE_CPU = 0, // The CPU engines and row-batch kernels
+    DEVICE_GPU = 1  // An OpenMP offload device, when built with -DMANDEL_OFFLOAD and one is present
+};
+const char *deviceNames[] = {"cpu", "gpu"}; // Names used by -device, indexed by DeviceType
+
+// Formats of the run statistics file that can be selected with -stats
+enum StatsFormat {
+    STATS_OFF = 0,  // No statistics: the counters below are never touched
+    STATS_JSON = 1, // One JSON object with the totals, every process and every thread
+    STATS_CSV = 2   // One row per thread and one per process
+};
+const char *statsFormatNames[] = {"off", "json", "csv"}; // Names used by -stats, indexed by StatsFormat
+
+// Phases of a run that -stats times per process, on the thread that drives the frame loop
+enum StatsPhase {
+    PHASE_RENDER = 0, // Rendering tiles (every thread of the team busy or stealing)
+    PHASE_GATHER = 1, // Moving finished rows between processes (only the MPI version has any)
+    PHASE_WRITE = 2,  // Writing the output files, or waiting for a background write to finish
+    PHASE_TOTAL = 3,  // The whole frame loop
+    NUM_STATS_PHASES = 4
+};
+const char *statsPhaseNames[] = {"render", "gather", "write", "total"}; // Names used in the statistics file, indexed by StatsPhase
+
+typedef std::chrono::steady_clock StatsClock; // Clock of the -stats timers: monotonic and cheap to read
+
+// Counters of one OpenMP thread for -stats. A thread only updates its own entry, and each entry has its own
+// cache line, so the counters cost no synchronization.
+struct alignas(64) ThreadStats {
+    double computeSeconds; // Time in the escape-time loops (computeSamples)
+    double colorSeconds; // Time mapping escape counts to colors and averaging them into pixels
+    uint64_t kernelSamples; // Samples run through an escape-time loop
+    uint64_t iterations; // Sum of the escape counts of those samples; an orbit stopped as a cycle counts max_iter
+    uint64_t interiorSamples; // Those of them that did not escape
+    uint64_t cardioidSkips; // Samples the interior check gave max_iter without iterating
+    uint64_t fillSkips; // Samples Mariani-Silver filled in from a uniform border without evaluating them
+    uint64_t adaptiveSkips; // Samples adaptive anti-aliasing did not take for pixels away from an edge
+};
+
+// Statistics of one process for -stats
+struct RunStats {
+    double seconds[NUM_STATS_PHASES]; // Wall time of each phase (see StatsPhase)
+    std::vector<ThreadStats> threads; // Counters of each OpenMP thread, indexed by thread number
+};
+
+// Adds the time from its construction to its destruction to *seconds; does nothing if seconds is NULL, which is
+// what phaseSeconds returns when -stats is off
+struct StatsTimer {
+    double *seconds;
+    StatsClock::time_point start;
+    explicit StatsTimer(double *seconds);
+    ~StatsTimer();
+};
+
+// Color scheme interface: computes the color of an escaped point; only called to fill the palette table
+typedef void (*PaletteFunction)(int iter, int &r, int &g, int &b);
+
+// Row-batch kernel interface: writes the escape count of sample (real[i], imag[i]) to iters[i] for i < count and,
+// if norms is not NULL, the |z|^2 of the first orbit point past the escape radius to norms[i] (for smooth coloring;
+// left as is for samples that reach max_iter)
+typedef void (*BatchKernel)(const double *real, const double *imag, int count, int max_iter, int *iters, float *norms);
+
+// Settings of the -precision option, shared by all tiles
+struct PrecisionSettings {
+    int precision; // Requested precision (see PrecisionType)
+    BatchKernel floatKernel; // Row-batch kernel for single-precision tiles
+    bool periodicity; // Cycle detection in double-double tiles (the row-batch kernels have it built in)
+    DoubleDouble center_x, center_y; // View center, which double-double samples are offsets from
+};
+
+// Fixed-point number used for the deep-zoom reference orbit: limb.back() is the signed integer part and the
+// other limbs are the fraction, least significant first, all in two's complement
+struct FixedPoint {
+    std::vector<uint32_t> limb;
+};
+
+// Orbit of the view center in deep-zoom mode, computed in fixed point and rounded to doubles
+struct ReferenceOrbit {
+    std::vector<double> zr, zi; // Z(0) = 0, Z(1), ... until the orbit escapes or max_iter is reached
+};
+
+// A grid of samples, one per pixel x0 <= x < x0 + w, y0 <= y < y0 + h at the same sub-pixel offset,
+// and the kernel settings to evaluate them with. iters receives the escape counts, row by row, and norms, with
+// smooth coloring, the |z|^2 each sample escaped with.
+struct SampleGrid {
+    int x0, y0, w, h; // Pixel of the first sample and size of the grid
+    double offX, offY; // Sub-pixel offset of the samples
+    double scale, move_x, move_y; // Mapping from pixel to complex coordinates
+    int max_iter; // Maximum iterations
+    BatchKernel kernel; // Row-batch kernel
+    bool interiorCheck; // Skip samples in the main cardioid and period-2 bulb
+    int precision; // Precision chosen for the grid (see PrecisionType, never PRECISION_AUTO)
+    const PrecisionSettings *settings; // Float kernel and double-double center
+    const ReferenceOrbit *orbit; // Reference orbit in deep-zoom mode (samples are then offsets from the center), else NULL
+    int *iters; // Escape counts, w * h of them
+    float *norms; // Escape |z|^2 of the samples, w * h of them, with smooth coloring; else NULL
+    RunStats *stats; // Counters for -stats, NULL when it is off
+};
+
+// Work arrays used by computeBatch to pack the samples that still need the kernel
+struct BatchScratch {
+    std::vector<double> real, imag; // Coordinates of the packed samples
+    std::vector<int> index; // Position of each packed sample in the original batch
+    std::vector<int> iters; // Escape counts of the packed samples
+    std::vector<float> norms; // Escape |z|^2 of the packed samples, with smooth coloring
+};
+
+// One view of a batch run and the file its image goes to
+struct Frame {
+    std::string center_x_text, center_y_text; // Center coordinates with every digit, as for the command-line view
+    double center_x, center_y; // The same rounded to double
+    double zoom; // Zoom level
+    std::string filename; // Output filename
+};
+
+// Settings of the batch options: keyframes from a file (-batch) or a path from the command-line view to an
+// end view (-x1, -y1, -z1), sampled at a number of frames (-frames)
+struct AnimationSettings {
+    std::string keyframeFile; // File with one "center_x center_y zoom" keyframe per line, or empty
+    std::string end_x_text, end_y_text; // End center of the path (empty means the start center)
+    double end_zoom; // End zoom of the path (0 means the start zoom)
+    int frames; // Frames to render along the keyframes or path (0 means one per keyframe)
+    bool batch; // Any batch option was given; frames are then numbered in their filenames
+};
+
+// Maximum length of the text fields of RenderConfig, including the terminating zero
+const int CONFIG_TEXT = 512;
+
+// Run configuration: every setting given on the command line. It holds no pointers, so the MPI version
+// broadcasts it from process 0 in a single call (see makeConfigType); both versions share the layout, and the
+// serial version ignores the settings that only mean something across processes.
+struct RenderConfig {
+    int width, height; // Image size in pixels
+    int max_iter; // Maximum iterations for determining if a point is in the Mandelbrot set
+    double center_x, center_y; // Center coordinates of the view
+    double zoom; // Zoom level
+    int aaSamples; // Anti-aliasing samples per pixel (a square number)
+    int aaMode; // Anti-aliasing mode (see AAMode)
+    int aaThreshold; // Color difference that marks a pixel for supersampling in adaptive mode
+    int numThreads; // OpenMP threads (0 means the runtime default, or in the MPI version the node layout)
+    int tileSize; // Side length in pixels of the square tiles handed to the threads
+    int sched; // Work distribution across MPI processes (see SchedMode in the MPI version)
+    int chunkRows; // Rows per chunk in the MPI dynamic and stream modes (0 means pick from the thread count)
+    int kernelType; // Requested escape-time kernel (see KernelType)
+    int unroll; // Iterations between escape tests in the escape-time loop
+    int precisionType; // Requested escape-time precision (see PrecisionType)
+    int engine; // Rendering engine (see EngineType)
+    int deepMode; // Deep-zoom mode (see DeepMode), resolved to DEEP_ON or DEEP_OFF by parseArguments unless in batch mode
+    int format; // Output image format (see ImageFormat)
+    int ioMode; // How the MPI version writes the image (see IOMode there)
+    int paletteType; // Color scheme (see PaletteType)
+    int coloring; // How escape counts are turned into palette colors (see ColoringMode)
+    int device; // Where the samples are computed (see DeviceType)
+    int stripRows; // Rows rendered and written out at a time (0 means pick from STRIP_BUDGET, see chooseStripRows)
+    int statsFormat; // Run statistics file written at the end (see StatsFormat)
+    bool interiorCheck; // Skip samples in the main cardioid and period-2 bulb
+    bool periodicity; // Stop iterating orbits that fall into a cycle
+    bool saveField; // Also write the escape count of every sample to an escape-field file (see FieldHeader)
+    char filename[CONFIG_TEXT]; // Output filename
+    char center_x_text[CONFIG_TEXT], center_y_text[CONFIG_TEXT]; // Center coordinates as given, for the full-precision reference orbit
+};
+
+// Per-frame state shared by the tile functions: the mapping from pixels to the complex plane and the kernels
+// and tables set up from the configuration
+struct RenderState {
+    double scale, move_x, move_y; // Mapping from pixel to complex coordinates
+    int aaSide; // Side length of the anti-aliasing sample grid
+    BatchKernel kernel; // Row-batch kernel
+    PrecisionSettings precision; // Float kernel and double-double center
+    const ReferenceOrbit *orbit; // Reference orbit in deep-zoom mode (samples are then offsets from the center), else NULL
+    const uint8_t *palette; // Color lookup table built by buildPalette
+    int device; // OpenMP device the rows are offloaded to (see chooseOffloadDevice), or -1 for the CPU engines
+    RunStats *stats; // Counters for -stats, NULL when it is off
+};
+
+// Header of an escape-field file (-field). The escape counts of every sample follow it: pixel by pixel in image
+// order, the aaSide x aaSide samples of each pixel row by row, countBytes bytes each in native byte order. With
+// FIELD_SMOOTH in flags each count is followed by the |z|^2 its sample escaped with, as a 4-byte float.
+// A recolor run reads the counts back and colors them without running the kernels again.
+struct FieldHeader {
+    char magic[8]; // FIELD_MAGIC
+    int32_t width, height; // Image size in pixels
+    int32_t aaSide; // Side length of the anti-aliasing sample grid of each pixel
+    int32_t max_iter; // Maximum iterations; samples with this count are inside the set
+    int32_t countBytes; // Bytes per escape count: 2 when max_iter fits into 16 bits, else 4
+    int32_t flags; // Per-sample data that follows each count: FIELD_SMOOTH or 0
+    double center_x, center_y, zoom; // View of the render, for reference
+};
+const char FIELD_MAGIC[8] = {'M', 'A', 'N', 'D', 'F', 'L', 'D', '1'}; // First bytes of an escape-field file
+const int32_t FIELD_SMOOTH = 1; // Flag of a field saved with -coloring smooth: each count is followed by its escape |z|^2
 
 // Forward declarations of functions used in this program
-void parseArguments(int argc, char *argv[], int &max_iter, double &center_x, double &center_y, double &zoom, std::string &filename, int &aaSamples);
-int computeMandelbrot(double real, double imag, int max_iter);
-void mapColor(int iter, int max_iter, int &r, int &g, int &b);
+void parseArguments(int argc, char *argv[], RenderConfig &config, AnimationSettings &animation);
+void setConfigText(char *field, const std::string &text);
+void setFrameView(const Frame &frame, RenderConfig &config);
+MPI_Datatype makeConfigType();
+void writeImage(const std::string &filename, int format, int width, int height, const uint8_t *rgb);
+void writeImageHeader(std::ofstream &imageFile, int format, int width, int height);
+void writeImageRows(std::ofstream *imageFile, int format, const uint8_t *rgb, int width, int rows, bool last);
+int chooseStripRows(const RenderConfig &config);
+std::string fieldFilename(const std::string &filename);
+int fieldCountBytes(int max_iter);
+int fieldSampleBytes(const FieldHeader &header);
+double secondsSince(StatsClock::time_point start);
+double *phaseSeconds(RunStats *stats, int phase);
+ThreadStats *threadStats(RunStats *stats);
+void addThreadStats(ThreadStats &a, const ThreadStats &b);
+std::string statsFilename(const std::string &filename, int format);
+std::string statsKey(bool json, const std::string &name);
+void writeThreadCounters(std::ostream &out, bool json, const ThreadStats &s);
+void writeStats(const std::string &path, int format, const RenderConfig &config, int frames, const std::vector<RunStats> &ranks);
+FieldHeader makeFieldHeader(const RenderConfig &config, int aaSide, double center_x, double center_y, double zoom);
+void packCounts(const int *counts, const float *norms, size_t count, int countBytes, uint8_t *out);
+std::string imageHeaderP6(int width, int height);
+void writeRowsAt(MPI_File fh, MPI_Offset start, int rowBytes, int firstRow, int numRows, int rowStep, const uint8_t *data, bool collective);
+void writeRowsMPIIO(MPI_File fh, int width, int height, int firstRow, int numRows, int rowStep, const uint8_t *rgb, bool collective);
+void writeFieldRowsMPIIO(MPI_File fh, int countBytes, int rowSamples, int firstRow, int numRows, int rowStep, const int *field, const float *norms, bool collective);
+DoubleDouble twoSum(double a, double b);
+DoubleDouble quickTwoSum(double a, double b);
+DoubleDouble twoProd(double a, double b);
+DoubleDouble operator+(DoubleDouble a, DoubleDouble b);
+DoubleDouble operator-(DoubleDouble a);
+DoubleDouble operator-(DoubleDouble a, DoubleDouble b);
+DoubleDouble operator*(DoubleDouble a, DoubleDouble b);
+bool operator<(DoubleDouble a, DoubleDouble b);
+bool operator<=(DoubleDouble a, DoubleDouble b);
+DoubleDouble fabs(DoubleDouble a);
+DoubleDouble doubleDoubleFromString(const std::string &text);
+template <typename T> T periodTolerance();
+template <typename T> float toFloat(T x);
+template <typename T, int Unroll = 1> int computeMandelbrot(T real, T imag, int max_iter, float *norm);
+template <typename T, int Unroll = 1> int computeMandelbrotPeriodic(T real, T imag, int max_iter, float *norm);
+template <typename T, bool Periodicity, int Unroll> void computeMandelbrotBatchScalar(const double *real, const double *imag, int count, int max_iter, int *iters, float *norms);
+#ifdef MANDEL_X86_SIMD
+template <bool Periodicity, int Unroll> __attribute__((target("avx2"))) void computeMandelbrotBatchAVX2(const double *real, const double *imag, int count, int max_iter, int *iters, float *norms);
+template <bool Periodicity, int Unroll> __attribute__((target("avx512f"), optimize("fp-contract=off"))) void computeMandelbrotBatchAVX512(const double *real, const double *imag, int count, int max_iter, int *iters, float *norms);
+template <bool Periodicity, int Unroll> __attribute__((target("avx2"))) void computeMandelbrotBatchAVX2Float(const double *real, const double *imag, int count, int max_iter, int *iters, float *norms);
+template <bool Periodicity, int Unroll> __attribute__((target("avx512f"), optimize("fp-contract=off"))) void computeMandelbrotBatchAVX512Float(const double *real, const double *imag, int count, int max_iter, int *iters, float *norms);
+#endif
+template <typename Family> BatchKernel instantiateKernel(bool periodicity, int unroll);
+BatchKernel selectKernel(int kernelType, bool periodicity, bool singlePrecision, int unroll, int &selected);
+int choosePrecision(int requested, int x0, int y0, int x1, int y1, double scale, double move_x, double move_y, int max_iter);
+bool usePerturbation(const RenderConfig &config, double center_x, double center_y, double zoom);
+SampleGrid makeSampleGrid(int x0, int y0, int w, int h, const RenderConfig &config, const RenderState &state, int *iters, float *norms);
+bool inCardioidOrBulb(double x, double y);
+int computeBatch(BatchKernel kernel, bool interiorCheck, const double *real, const double *imag, int count, int max_iter, int *iters, float *norms, BatchScratch &scratch);
+void mapColor(int iter, const uint8_t *palette, int &r, int &g, int &b);
+void mapColorSmooth(int iter, float norm, int max_iter, const uint8_t *palette, int &r, int &g, int &b);
+void mapSampleColor(const int *iters, const float *norms, int k, int max_iter, const uint8_t *palette, int &r, int &g, int &b);
+void paletteSine(int iter, int &r, int &g, int &b);
+void paletteFire(int iter, int &r, int &g, int &b);
+void paletteIce(int iter, int &r, int &g, int &b);
+void paletteGray(int iter, int &r, int &g, int &b);
+void buildPalette(int paletteType, int max_iter, std::vector<uint8_t> &palette);
+void sampleCells(const SampleGrid &grid, const std::vector<int> &cells);
+void marianiSilver(const SampleGrid &grid, int i0, int j0, int i1, int j1);
+void computeSampleGrid(int engine, const SampleGrid &grid);
+template <int AASide> void accumulateSamples(int aaSide, int engine, SampleGrid &grid, const uint8_t *palette, double *totalR, double *totalG, double *totalB, int *field, float *fieldNorms, int stride);
+void computeSamples(const SampleGrid &grid, const double *real, const double *imag, int count, int *iters, float *norms, BatchScratch &scratch);
+void fixedNegate(FixedPoint &a);
+FixedPoint fixedAdd(const FixedPoint &a, const FixedPoint &b);
+FixedPoint fixedSub(const FixedPoint &a, const FixedPoint &b);
+FixedPoint fixedMul(const FixedPoint &a, const FixedPoint &b);
+double fixedToDouble(const FixedPoint &a);
+FixedPoint fixedFromString(const std::string &text, int limbs);
+std::string fixedToString(const FixedPoint &a, int digits);
+std::string frameFilename(const std::string &filename, int index);
+bool readKeyframes(const std::string &path, std::vector<Frame> &keyframes);
+Frame interpolateFrame(const Frame &a, const Frame &b, double t, int width);
+void buildFrames(const AnimationSettings &animation, const RenderConfig &config, std::vector<Frame> &frames);
+void computeReferenceOrbit(const std::string &center_x, const std::string &center_y, double zoom, int width, int max_iter, ReferenceOrbit &orbit);
+int computeMandelbrotPerturbed(const ReferenceOrbit &orbit, double dcr, double dci, int max_iter, float *norm);
+void computeTileAdaptive(int x0, int y0, int x1, int y1, const RenderConfig &config, const RenderState &state, uint8_t *rgb, int stride);
+void computeTile(int x0, int y0, int x1, int y1, const RenderConfig &config, const RenderState &state, uint8_t *rgb, int stride, int *field, float *fieldNorms);
+int chooseOffloadDevice(const RenderConfig &config, int localRank, int localRanks, bool report);
+#ifdef MANDEL_OFFLOAD
+bool frameOnDevice(const RenderConfig &config, const RenderState &state);
+int computeMandelbrotDevice(double real, double imag, int max_iter, bool periodicity, double tolerance, float *norm);
+void renderRowsDevice(int firstRow, int numRows, int rowStep, const RenderConfig &config, const RenderState &state, uint8_t *rgb);
+#pragma omp declare target(inCardioidOrBulb, mapColor, mapColorSmooth, computeMandelbrotDevice) // Also built for the offload device
+#endif
+void renderRows(int firstRow, int numRows, int rowStep, const RenderConfig &config, const RenderState &state, uint8_t *rgb, int *field, float *fieldNorms);
+int chooseThreadsPerRank(int numThreads, int localRanks);
+void runDynamicMaster(const RenderConfig &config, int size, MPI_Datatype pixelType, uint8_t *all_rgb, MPI_File *out, RunStats *stats);
+void runDynamicWorker(const RenderConfig &config, const RenderState &state, MPI_Datatype pixelType, MPI_File *fh, MPI_File *fieldFh);
+void localRows(int sched, int height, int rank, int size, int &firstRow, int &numRows, int &rowStep);
+void placeChunk(const RenderConfig &config, int size, int source, int chunk, const uint8_t *pixels, uint8_t *frameRgb, MPI_File *out, RunStats *stats);
+void gatherStats(int rank, int size, const RunStats &local, std::vector<RunStats> &ranks);
+void streamRows(int rank, int size, const RenderConfig &config, const RenderState &state, MPI_Datatype pixelType, uint8_t *frameRgb, MPI_File *out);
+void renderStrips(int rank, int size, const RenderConfig &config, const RenderState &state, MPI_File fh, MPI_File *fieldFh);
 
 int main(int argc, char* argv[]) {
 
     int rank, size; // Rank and size of MPI communicator
 
-    MPI_Init(&argc, &argv); // Initialize MPI environment
+    // Initialize MPI environment. Only the main thread makes MPI calls, outside the OpenMP regions
+    int provided;
+    MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
     MPI_Comm_rank(MPI_COMM_WORLD, &rank); // Rank of the current process
     MPI_Comm_size(MPI_COMM_WORLD, &size); // Total number of processes
 
-    // Variables to hold the parameters for generating the Mandelbrot set image
-    int max_iter; // Maximum iterations for determining if a point is in the Mandelbrot set
-    double center_x, center_y; // Center coordinates of the view
-    double zoom; // Zoom level
-    std::string filename; // Output filename for the image
+    // Find the processes sharing this node, so the thread team can be sized to the cores left for each of them
+    MPI_Comm nodeComm;
+    MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, rank, MPI_INFO_NULL, &nodeComm);
+    int localRank, localRanks;
+    MPI_Comm_rank(nodeComm, &localRank);
+    MPI_Comm_size(nodeComm, &localRanks);
+    int nodeLeaders = (localRank == 0) ? 1 : 0;
+    int numNodes;
+    MPI_Allreduce(&nodeLeaders, &numNodes, 1, MPI_INT, MPI_SUM, MPI_COMM_WORLD);
+    MPI_Comm_free(&nodeComm);
 
-    int aaSamples; // Variable to hold the number of anti-aliasing samples per pixel
+    RenderConfig config = RenderConfig(); // Parameters for generating the Mandelbrot set image
+    AnimationSettings animation; // Batch options
+
+    std::vector<Frame> frames; // Views to render, only listed on process 0
+    int numFrames = 0;
+    std::string statsPath; // Statistics file, named after the base filename on process 0
 
     // Only process 0 parses the arguments
     if (rank == 0) {
-    // Parse command-line arguments to set the above parameters
-    parseArguments(argc, argv, max_iter, center_x, center_y, zoom, filename, aaSamples);
-   }
+        // Parse command-line arguments to set the above parameters
+        parseArguments(argc, argv, config, animation);
+        // The views to render: the command-line view, or every frame of the batch
+        buildFrames(animation, config, frames);
+        numFrames = frames.size();
+        if (animation.batch) {
+            std::cout << std::left << std::setw(20) << "Batch Frames:" << numFrames << "\n";
+        }
+        statsPath = statsFilename(config.filename, config.statsFormat);
+        setFrameView(frames[0], config);
+    }
+
+    // PE0 broadcasts the parameters, with the view of the first frame, to all processes in one message
+    MPI_Datatype configType = makeConfigType();
+    MPI_Bcast(&numFrames, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    MPI_Bcast(&config, 1, configType, 0, MPI_COMM_WORLD);
+
+    // Each process checks its own CPU, so a job spanning different node types still runs everywhere
+    RenderState state; // Per-frame state of the tile functions
+    int kernelSelected;
+    state.kernel = selectKernel(config.kernelType, config.periodicity, false, config.unroll, kernelSelected);
+
+    // With -device gpu every process takes one of the offload devices of its node, by its rank on the node
+    state.device = chooseOffloadDevice(config, localRank, localRanks, rank == 0);
+
+    // Size the OpenMP team of this process from the node layout
+    int threadsPerRank = chooseThreadsPerRank(config.numThreads, localRanks);
+#ifdef _OPENMP
+    omp_set_num_threads(threadsPerRank);
+#endif
+    if (rank == 0) {
+        std::cout << std::left << std::setw(20) << "Nodes:" << numNodes << "\n";
+        std::cout << std::left << std::setw(20) << "Ranks per Node:" << localRanks << "\n";
+        std::cout << std::left << std::setw(20) << "Threads per Rank:" << threadsPerRank << "\n";
+        std::cout << std::left << std::setw(20) << "Kernel Selected:" << kernelNames[kernelSelected] << "\n";
+        std::cout << std::left << std::setw(20) << "Device Selected:";
+        if (state.device >= 0) {
+            std::cout << "gpu " << state.device << " (one per rank on the node)\n";
+        } else {
+            std::cout << "cpu\n";
+        }
+        if (threadsPerRank > 1 && provided < MPI_THREAD_FUNNELED) {
+            std::cerr << "Warning: MPI library does not provide MPI_THREAD_FUNNELED\n";
+        }
+    }
+
+    // With -stats every thread of the team gets its own counters
+    RunStats stats = RunStats();
+    if (config.statsFormat != STATS_OFF) {
+        stats.threads.resize(threadsPerRank);
+    }
+    state.stats = (config.statsFormat != STATS_OFF) ? &stats : NULL;
+
+    // With a thread team per process, hand out bands of whole tile rows so every thread has tiles to steal
+    if (config.chunkRows == 0) {
+        config.chunkRows = (threadsPerRank > 1) ? config.tileSize : 4;
+    }
 
-    // PE0 broadcasts parameters to all processes
-    MPI_Bcast(&max_iter, 1, MPI_INT, 0, MPI_COMM_WORLD);
-    MPI_Bcast(&center_x, 1, MPI_DOUBLE, 0, MPI_COMM_WORLD);
-    MPI_Bcast(&center_y, 1, MPI_DOUBLE, 0, MPI_COMM_WORLD);
-    MPI_Bcast(&zoom, 1, MPI_DOUBLE, 0, MPI_COMM_WORLD);
-    MPI_Bcast(&aaSamples, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    // Build the color lookup table once; the inner loop only indexes it
+    std::vector<uint8_t> palette;
+    buildPalette(config.paletteType, config.max_iter, palette);
+    state.palette = palette.data();
 
     // Calculate the side length of the anti-aliasing square grid
-    int aaSide = std::sqrt(aaSamples);
-
-    // Compute scale factors for the Mandelbrot set based on the zoom level and image dimensions
-    double scale = 4.0 / (WIDTH * zoom);
-    double move_x = center_x - WIDTH / 2.0 * scale;
-    double move_y = center_y - HEIGHT / 2.0 * scale;
-
-
-    // Compute the portion of the image to be computed by each process
-    int start_row = rank * (HEIGHT / size);
-    int end_row = (rank + 1) * (HEIGHT / size);
-    if (rank == size - 1) {
-        end_row = HEIGHT; // Last process computes the remaining rows
-    }
-
-    // Vectors to store the red, green, and blue components of each pixel
-    std::vector<int> red((end_row - start_row) * WIDTH);
-    std::vector<int> green((end_row - start_row) * WIDTH);
-    std::vector<int> blue((end_row - start_row) * WIDTH);
-
-    // Generate the image
-    for (int y = start_row; y < end_row; ++y) {
-        for (int x = 0; x < WIDTH; ++x) {
-            // Variables to accumulate color values for anti-aliasing
-            double totalR = 0, totalG = 0, totalB = 0;
-            for (int dy = 0; dy < aaSide; ++dy) {
-                for (int dx = 0; dx < aaSide; ++dx) {
-                    // Compute the real and imaginary parts of the complex number for this sample
-                    double real = (x + (dx / (double)aaSide)) * scale + move_x;
-                    double imag = (y + (dy / (double)aaSide)) * scale + move_y;
-                    // Compute how many iterations it takes for the complex number to escape
-                    int iter = computeMandelbrot(real, imag, max_iter);
-                    // Map the iteration count to a color
-                    int r, g, b;
-                    mapColor(iter, max_iter, r, g, b);
-                    // Accumulate the color values
-                    totalR += r;
-                    totalG += g;
-                    totalB += b;
-                }
-            }
+    state.aaSide = std::sqrt(config.aaSamples);
 
-    
-            // Compute the average color values for this pixel and clamp to [0, 255]
-            int idx = (y- start_row) * WIDTH + x;
-            red[idx] = std::min(255, static_cast<int>(totalR / aaSamples));
-            green[idx] = std::min(255, static_cast<int>(totalG / aaSamples));
-            blue[idx] = std::min(255, static_cast<int>(totalB / aaSamples));
+    // Single-precision kernel for the tiles that choosePrecision sends there
+    state.precision.precision = config.precisionType;
+    state.precision.floatKernel = selectKernel(config.kernelType, config.periodicity, true, config.unroll, kernelSelected);
+    state.precision.periodicity = config.periodicity;
+
+    // The dynamic scheduler needs at least one worker besides the master
+    if (config.sched == SCHED_DYNAMIC && size == 1) {
+        config.sched = SCHED_STATIC;
+    }
 
+    // ASCII P3 has variable-width pixels, so only P6 can be written at computed offsets
+    bool parallelIO = (config.ioMode == IO_MPIIO && config.format == FORMAT_P6);
+    bool streamFile = (config.ioMode == IO_STREAM && config.format == FORMAT_P6); // Process 0 writes chunks as they arrive
 
+    // Full-image frame buffers (interleaved 8-bit RGB), only filled on process 0 when it assembles the frame.
+    // With several frames there are two, so one frame is written out in the background while the next is computed.
+    // The parallel and stream P6 output write the file piece by piece and never hold a whole frame
+    std::vector<uint8_t> all_rgb[2];
+    if (rank == 0 && !parallelIO && !streamFile) {
+        all_rgb[0].resize(3 * (size_t)config.width * config.height);
+        if (numFrames > 1) {
+            all_rgb[1].resize(3 * (size_t)config.width * config.height);
         }
     }
-    // Gather results from all processes
-    std::vector<int> all_red(WIDTH * HEIGHT);
-    std::vector<int> all_green(WIDTH * HEIGHT);
-    std::vector<int> all_blue(WIDTH * HEIGHT);
+    std::future<void> pendingWrite; // Write of the previous frame on process 0, if one is in flight
 
-    MPI_Gather(red.data(), (end_row - start_row) * WIDTH, MPI_INT, all_red.data(), (end_row - start_row) * WIDTH, MPI_INT, 0, MPI_COMM_WORLD);
-    MPI_Gather(green.data(), (end_row - start_row) * WIDTH, MPI_INT, all_green.data(), (end_row - start_row) * WIDTH, MPI_INT, 0, MPI_COMM_WORLD);
-    MPI_Gather(blue.data(), (end_row - start_row) * WIDTH, MPI_INT, all_blue.data(), (end_row - start_row) * WIDTH, MPI_INT, 0, MPI_COMM_WORLD);
+    // Buffers of the static and cyclic schedules in gather mode, reused by every frame
+    std::vector<uint8_t> rgb; // This process's rows
+    std::vector<uint8_t> gathered; // Rows gathered on process 0, grouped by process (cyclic schedule)
 
-    // Process 0 writes the image to file
-    if (rank == 0) {
-    // Open the output file
-    std::ofstream imageFile(filename);
-    // Write the PNM file header 
-    imageFile << "P3\n" << WIDTH << " " << HEIGHT << "\n255\n";
-    //imageFile.close();
-    //std::ofstream imageFile(filename);
-    //imageFile << "write data";
-    // Write the pixel data
-    for (int y = 0; y < HEIGHT; ++y) {
-        for (int x = 0; x < WIDTH; ++x) {
-            int idx = y * WIDTH + x;
-            imageFile << all_red[idx] << " " << all_green[idx] << " " << all_blue[idx] << "\n";
+    // One RGB pixel, so every transfer is a single message counted in pixels
+    MPI_Datatype pixelType;
+    MPI_Type_contiguous(3, MPI_UNSIGNED_CHAR, &pixelType);
+    MPI_Type_commit(&pixelType);
+    // One image row, so the gathers count whole rows and their counts and offsets fit an int at any image size
+    MPI_Datatype rowType;
+    MPI_Type_contiguous(config.width, pixelType, &rowType);
+    MPI_Type_commit(&rowType);
+
+    StatsClock::time_point runStart = StatsClock::now();
+    ReferenceOrbit referenceOrbit;
+    for (int f = 0; f < numFrames; ++f) {
+        // PE0 broadcasts the configuration again with the view of each later frame; every process needs
+        // the filename to open the shared file for parallel output
+        if (f > 0) {
+            if (rank == 0) {
+                setFrameView(frames[f], config);
+            }
+            MPI_Bcast(&config, 1, configType, 0, MPI_COMM_WORLD);
         }
+        if (rank == 0 && animation.batch) {
+            std::cout << "Frame " << f + 1 << "/" << numFrames << ": center (" << config.center_x << ", " << config.center_y << "), zoom " << config.zoom << " -> " << config.filename << "\n";
+        }
+
+        // Compute scale factors for the Mandelbrot set based on the zoom level and image dimensions
+        state.scale = 4.0 / (config.width * config.zoom);
+        state.move_x = config.center_x - config.width / 2.0 * state.scale;
+        state.move_y = config.center_y - config.height / 2.0 * state.scale;
+
+        // In deep-zoom mode samples are offsets from the view center, whose orbit is computed in fixed point
+        bool deep = usePerturbation(config, config.center_x, config.center_y, config.zoom);
+        if (deep) {
+            state.move_x = -config.width / 2.0 * state.scale;
+            state.move_y = -config.height / 2.0 * state.scale;
+            // Process 0 computes the orbit once and sends it to everyone
+            int orbitLength = 0;
+            if (rank == 0) {
+                computeReferenceOrbit(config.center_x_text, config.center_y_text, config.zoom, config.width, config.max_iter, referenceOrbit);
+                orbitLength = referenceOrbit.zr.size();
+                std::cout << std::left << std::setw(20) << "Reference Orbit:" << orbitLength - 1 << " iterations\n";
+            }
+            MPI_Bcast(&orbitLength, 1, MPI_INT, 0, MPI_COMM_WORLD);
+            referenceOrbit.zr.resize(orbitLength);
+            referenceOrbit.zi.resize(orbitLength);
+            MPI_Bcast(referenceOrbit.zr.data(), orbitLength, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+            MPI_Bcast(referenceOrbit.zi.data(), orbitLength, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+        }
+        state.orbit = deep ? &referenceOrbit : NULL;
+
+        // Double-double center for the tiles that choosePrecision sends there
+        state.precision.center_x = doubleDoubleFromString(config.center_x_text);
+        state.precision.center_y = doubleDoubleFromString(config.center_y_text);
+
+        // Process 0 assembles this frame in the buffer that is not being written out
+        uint8_t *frameRgb = (rank == 0 && !parallelIO && !streamFile) ? all_rgb[f % 2].data() : NULL;
+
+        // In parallel output mode open the shared file; process 0 writes the header, the pixels follow at fixed offsets
+        StatsClock::time_point openStart = StatsClock::now();
+        MPI_File fh;
+        if (parallelIO) {
+            MPI_File_open(MPI_COMM_WORLD, config.filename, MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL, &fh);
+            std::string header = imageHeaderP6(config.width, config.height);
+            MPI_File_set_size(fh, header.size() + (MPI_Offset)3 * config.width * config.height); // Drop any longer old file contents
+            if (rank == 0) {
+                MPI_File_write_at(fh, 0, header.data(), header.size(), MPI_CHAR, MPI_STATUS_IGNORE);
+            }
+        }
+        // The escape field is written the same way into a second shared file
+        MPI_File fieldFh;
+        MPI_File *fieldOut = config.saveField ? &fieldFh : NULL;
+        if (fieldOut != NULL) {
+            FieldHeader header = makeFieldHeader(config, state.aaSide, config.center_x, config.center_y, config.zoom);
+            MPI_File_open(MPI_COMM_WORLD, fieldFilename(config.filename).c_str(), MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL, fieldOut);
+            MPI_File_set_size(*fieldOut, sizeof header + (MPI_Offset)fieldSampleBytes(header) * config.aaSamples * config.width * config.height);
+            if (rank == 0) {
+                MPI_File_write_at(*fieldOut, 0, &header, sizeof header, MPI_BYTE, MPI_STATUS_IGNORE);
+            }
+        }
+        // In stream mode process 0 alone has the file open, and writes each chunk into it as it arrives
+        MPI_File streamFh;
+        MPI_File *streamOut = (streamFile && rank == 0) ? &streamFh : NULL;
+        if (streamOut != NULL) {
+            MPI_File_open(MPI_COMM_SELF, config.filename, MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL, streamOut);
+            std::string header = imageHeaderP6(config.width, config.height);
+            MPI_File_set_size(*streamOut, header.size() + (MPI_Offset)3 * config.width * config.height);
+            MPI_File_write_at(*streamOut, 0, header.data(), header.size(), MPI_CHAR, MPI_STATUS_IGNORE);
+        }
+        stats.seconds[PHASE_WRITE] += secondsSince(openStart);
+
+        if (config.sched == SCHED_DYNAMIC) {
+            // Process 0 only distributes work and collects results; all other processes compute
+            if (rank == 0) {
+                runDynamicMaster(config, size, pixelType, frameRgb, streamOut, state.stats);
+            } else {
+                runDynamicWorker(config, state, pixelType, parallelIO ? &fh : NULL, fieldOut);
+            }
+        } else if (config.ioMode == IO_STREAM) {
+            // Static or cyclic rows, sent to process 0 chunk by chunk while the next chunk is computed
+            streamRows(rank, size, config, state, pixelType, frameRgb, streamOut);
+        } else if (parallelIO) {
+            // Static or cyclic rows, written into the shared file strip by strip
+            renderStrips(rank, size, config, state, fh, fieldOut);
+        } else if (config.sched == SCHED_CYCLIC) {
+            // Each process computes rows rank, rank + size, rank + 2*size, ...
+            // Neighbouring rows cost about the same, so every process gets a similar share of the work
+            const int width = config.width;
+            int local_rows = (config.height - rank + size - 1) / size;
+
+            // Frame buffer for this process's rows, stored consecutively
+            rgb.resize(3 * (size_t)local_rows * width);
+
+            renderRows(rank, local_rows, size, config, state, rgb.data(), NULL, NULL);
+
+            // Row counts differ by one between processes when height % size != 0, so use MPI_Gatherv
+            std::vector<int> counts(size), displs(size);
+            for (int r = 0, offset = 0; r < size; ++r) {
+                counts[r] = (config.height - r + size - 1) / size;
+                displs[r] = offset;
+                offset += counts[r];
+            }
+
+            // The gathered rows arrive grouped by process; reorder them into image order
+            StatsTimer timer(phaseSeconds(state.stats, PHASE_GATHER));
+            gathered.resize(rank == 0 ? 3 * (size_t)width * config.height : 0);
+            MPI_Gatherv(rgb.data(), local_rows, rowType, gathered.data(), counts.data(), displs.data(), rowType, 0, MPI_COMM_WORLD);
+            if (rank == 0) {
+                for (int r = 0; r < size; ++r) {
+                    for (int k = 0; k < counts[r]; ++k) {
+                        int y = r + k * size;
+                        std::copy(gathered.data() + 3 * (size_t)(displs[r] + k) * width, gathered.data() + 3 * (size_t)(displs[r] + k + 1) * width, &frameRgb[3 * (size_t)y * width]);
+                    }
+                }
+            }
+        } else {
+            // Compute the portion of the image to be computed by each process
+            const int width = config.width;
+            int start_row, local_rows, step;
+            localRows(SCHED_STATIC, config.height, rank, size, start_row, local_rows, step);
+
+            // Frame buffer holding the red, green, and blue components of each pixel in this band, interleaved
+            rgb.resize(3 * (size_t)local_rows * width);
+
+            // Generate the image
+            renderRows(start_row, local_rows, 1, config, state, rgb.data(), NULL, NULL);
+
+            // Gather results from all processes; the last band is longer when height % size != 0
+            std::vector<int> counts(size), displs(size);
+            for (int r = 0; r < size; ++r) {
+                int first, rows;
+                localRows(SCHED_STATIC, config.height, r, size, first, rows, step);
+                counts[r] = rows;
+                displs[r] = first;
+            }
+            StatsTimer timer(phaseSeconds(state.stats, PHASE_GATHER));
+            MPI_Gatherv(rgb.data(), local_rows, rowType, frameRgb, counts.data(), displs.data(), rowType, 0, MPI_COMM_WORLD);
+        }
+
+        StatsTimer timer(phaseSeconds(state.stats, PHASE_WRITE));
+        if (fieldOut != NULL) {
+            MPI_File_close(fieldOut);
+        }
+        if (parallelIO) {
+            MPI_File_close(&fh);
+        } else if (streamOut != NULL) {
+            MPI_File_close(streamOut);
+        } else if (rank == 0) {
+            // Process 0 writes the image to file once the previous frame's write, which used the other buffer, is done
+            if (pendingWrite.valid()) {
+                pendingWrite.wait();
+            }
+            pendingWrite = std::async(std::launch::async, writeImage, std::string(config.filename), config.format, config.width, config.height, frameRgb);
+        }
+    }
+    if (pendingWrite.valid()) {
+        StatsTimer timer(phaseSeconds(state.stats, PHASE_WRITE));
+        pendingWrite.wait();
     }
-    // Close the file
-    imageFile.close();
+    stats.seconds[PHASE_TOTAL] = secondsSince(runStart);
+
+    // Process 0 collects the statistics of every process and writes them out
+    if (config.statsFormat != STATS_OFF) {
+        std::vector<RunStats> ranks;
+        gatherStats(rank, size, stats, ranks);
+        if (rank == 0) {
+            writeStats(statsPath, config.statsFormat, config, numFrames, ranks);
+        }
     }
+    MPI_Type_free(&rowType);
+    MPI_Type_free(&pixelType);
+    MPI_Type_free(&configType);
 
     MPI_Finalize(); // Finalize MPI environment
 
     return 0; // Successful program termination
 }
 
-void parseArguments(int argc, char *argv[], int &max_iter, double &center_x, double &center_y, double &zoom, std::string &filename, int &aaSamples) {
+void parseArguments(int argc, char *argv[], RenderConfig &config, AnimationSettings &animation) {
+    // Text settings are collected as strings and copied into config at the end
+    std::string filename, center_x_text, center_y_text;
+
     // Default values for the parameters
-    aaSamples = 4; // Default AA samples to 4 (2x2 grid)
+    config.width = WIDTH; // Default to the original 1920x1080 image
+    config.height = HEIGHT;
+    config.stripRows = 0; // Default to strips that fit in STRIP_BUDGET
+    config.saveField = false; // Default to writing the image only
+    config.statsFormat = STATS_OFF; // Default to no statistics file
+    config.sched = SCHED_STATIC; // Default to the original contiguous block split
+    config.chunkRows = 0; // Default rows per dynamic work request: 4, or one tile row when threaded
+    config.numThreads = 0; // Default to OMP_NUM_THREADS, or the node's cores divided among its processes
+    config.tileSize = 32; // Default 32x32 pixel tiles
+    config.kernelType = KERNEL_AUTO; // Default to the widest SIMD kernel the CPU supports
+    config.device = DEVICE_CPU; // Default to the CPU engines
+    config.format = FORMAT_P6; // Default to binary output
+    config.paletteType = PALETTE_SINE; // Default to the original color scheme
+    config.coloring = COLORING_ITER; // Default to one palette entry per escape count
+    config.interiorCheck = true; // Default to the analytic cardioid/bulb early-out
+    config.periodicity = true; // Default to cycle detection in the escape loop
+    config.engine = ENGINE_BRUTE; // Default to evaluating every sample
+    config.ioMode = IO_GATHER; // Default to writing the file from process 0
+    config.aaSamples = 4; // Default AA samples to 4 (2x2 grid)
+    config.aaMode = AA_FULL; // Default to supersampling every pixel
+    config.aaThreshold = 8; // Default to a difference of more than 8 levels in any channel
     filename = "mandelbrot.pnm"; // Default output filename
-    max_iter = 10000; // Default maximum iterations for the Mandelbrot computation
-    center_x = -0.75; // Default X coordinate of the view center
-    center_y = 0.0; // Default Y coordinate of the view center
-    zoom = 1.0; // Default zoom level
+    config.max_iter = 10000; // Default maximum iterations for the Mandelbrot computation
+    config.center_x = -0.75; // Default X coordinate of the view center
+    config.center_y = 0.0; // Default Y coordinate of the view center
+    center_x_text = "-0.75";
+    center_y_text = "0";
+    config.deepMode = DEEP_AUTO; // Default to perturbation only when double coordinates run out of precision
+    config.precisionType = PRECISION_AUTO; // Default to double, and double-double where a tile needs it
+    config.unroll = 4; // Default to testing for escape every 4 iterations
+    config.zoom = 1.0; // Default zoom level
+    animation.keyframeFile = ""; // Default to the single command-line view
+    animation.end_zoom = 0.0;
+    animation.frames = 0;
+    animation.batch = false;
 
     // Loop through the command-line arguments to override defaults
     for (int i = 1; i < argc; i++) {
@@ -150,55 +792,2723 @@ void parseArguments(int argc, char *argv[], int &max_iter, double &center_x, dou
             if (filename.size() < 4 || filename.substr(filename.size() - 4) != ".pnm") {
                 filename += ".pnm";
             }
+        } else if (arg == "-w" && i + 1 < argc) {
+            config.width = std::stoi(argv[++i]);
+            if (config.width < 1) config.width = 1;
+        } else if (arg == "-h" && i + 1 < argc) {
+            config.height = std::stoi(argv[++i]);
+            if (config.height < 1) config.height = 1;
+        } else if (arg == "-strip" && i + 1 < argc) {
+            config.stripRows = std::stoi(argv[++i]);
+            if (config.stripRows < 0) config.stripRows = 0;
         } else if (arg == "-i" && i + 1 < argc) {
-            max_iter = std::stoi(argv[++i]);
+            config.max_iter = std::stoi(argv[++i]);
         } else if (arg == "-x" && i + 1 < argc) {
-            center_x = atof(argv[++i]);
+            center_x_text = argv[++i];
+            config.center_x = atof(center_x_text.c_str());
         } else if (arg == "-y" && i + 1 < argc) {
-            center_y = atof(argv[++i]);
+            center_y_text = argv[++i];
+            config.center_y = atof(center_y_text.c_str());
         } else if (arg == "-z" && i + 1 < argc) {
-            zoom = atof(argv[++i]);
+            config.zoom = atof(argv[++i]);
+        } else if (arg == "-batch" && i + 1 < argc) {
+            animation.keyframeFile = argv[++i];
+            animation.batch = true;
+        } else if (arg == "-x1" && i + 1 < argc) {
+            animation.end_x_text = argv[++i];
+            animation.batch = true;
+        } else if (arg == "-y1" && i + 1 < argc) {
+            animation.end_y_text = argv[++i];
+            animation.batch = true;
+        } else if (arg == "-z1" && i + 1 < argc) {
+            animation.end_zoom = atof(argv[++i]);
+            animation.batch = true;
+        } else if (arg == "-frames" && i + 1 < argc) {
+            animation.frames = std::stoi(argv[++i]);
+            if (animation.frames < 1) animation.frames = 1;
+            animation.batch = true;
         } else if (arg == "-aa" && i + 1 < argc) {
-            aaSamples = std::stoi(argv[++i]);
-            if (aaSamples < 1) aaSamples = 1;
+            config.aaSamples = std::stoi(argv[++i]);
+            if (config.aaSamples < 1) config.aaSamples = 1;
+        } else if (arg == "-aamode" && i + 1 < argc) {
+            std::string name = argv[++i];
+            if (name == "adaptive") {
+                config.aaMode = AA_ADAPTIVE;
+            } else if (name == "full") {
+                config.aaMode = AA_FULL;
+            } else {
+                std::cerr << "Unknown anti-aliasing mode '" << name << "', using full\n";
+                config.aaMode = AA_FULL;
+            }
+        } else if (arg == "-aathreshold" && i + 1 < argc) {
+            config.aaThreshold = std::stoi(argv[++i]);
+            if (config.aaThreshold < 0) config.aaThreshold = 0;
+        } else if (arg == "-sched" && i + 1 < argc) {
+            std::string mode = argv[++i];
+            if (mode == "static") {
+                config.sched = SCHED_STATIC;
+            } else if (mode == "cyclic") {
+                config.sched = SCHED_CYCLIC;
+            } else if (mode == "dynamic") {
+                config.sched = SCHED_DYNAMIC;
+            } else {
+                std::cerr << "Unknown scheduling mode '" << mode << "', using static\n";
+                config.sched = SCHED_STATIC;
+            }
+        } else if (arg == "-chunk" && i + 1 < argc) {
+            config.chunkRows = std::stoi(argv[++i]);
+            if (config.chunkRows < 1) config.chunkRows = 1;
+        } else if (arg == "-t" && i + 1 < argc) {
+            config.numThreads = std::stoi(argv[++i]);
+            if (config.numThreads < 0) config.numThreads = 0;
+        } else if (arg == "-tile" && i + 1 < argc) {
+            config.tileSize = std::stoi(argv[++i]);
+            if (config.tileSize < 1) config.tileSize = 1;
+        } else if (arg == "-kernel" && i + 1 < argc) {
+            std::string name = argv[++i];
+            config.kernelType = -1;
+            for (int k = KERNEL_AUTO; k <= KERNEL_AVX512; ++k) {
+                if (name == kernelNames[k]) config.kernelType = k;
+            }
+            if (config.kernelType < 0) {
+                std::cerr << "Unknown kernel '" << name << "', using auto\n";
+                config.kernelType = KERNEL_AUTO;
+            }
+        } else if (arg == "-engine" && i + 1 < argc) {
+            std::string name = argv[++i];
+            config.engine = -1;
+            for (int k = ENGINE_BRUTE; k <= ENGINE_MS; ++k) {
+                if (name == engineNames[k]) config.engine = k;
+            }
+            if (config.engine < 0) {
+                std::cerr << "Unknown engine '" << name << "', using brute\n";
+                config.engine = ENGINE_BRUTE;
+            }
+        } else if (arg == "-unroll" && i + 1 < argc) {
+            config.unroll = std::stoi(argv[++i]);
+            if (config.unroll != 1 && config.unroll != 2 && config.unroll != 4 && config.unroll != 8) {
+                std::cerr << "Unroll factor must be 1, 2, 4 or 8, using 4\n";
+                config.unroll = 4;
+            }
+        } else if (arg == "-precision" && i + 1 < argc) {
+            std::string name = argv[++i];
+            config.precisionType = -1;
+            for (int k = PRECISION_AUTO; k <= PRECISION_DD; ++k) {
+                if (name == precisionNames[k]) config.precisionType = k;
+            }
+            if (config.precisionType < 0) {
+                std::cerr << "Unknown precision '" << name << "', using auto\n";
+                config.precisionType = PRECISION_AUTO;
+            }
+        } else if (arg == "-deep" && i + 1 < argc) {
+            std::string name = argv[++i];
+            config.deepMode = -1;
+            for (int k = DEEP_AUTO; k <= DEEP_OFF; ++k) {
+                if (name == deepModeNames[k]) config.deepMode = k;
+            }
+            if (config.deepMode < 0) {
+                std::cerr << "Unknown deep-zoom mode '" << name << "', using auto\n";
+                config.deepMode = DEEP_AUTO;
+            }
+        } else if (arg == "-palette" && i + 1 < argc) {
+            std::string name = argv[++i];
+            config.paletteType = -1;
+            for (int k = PALETTE_SINE; k <= PALETTE_GRAY; ++k) {
+                if (name == paletteNames[k]) config.paletteType = k;
+            }
+            if (config.paletteType < 0) {
+                std::cerr << "Unknown palette '" << name << "', using sine\n";
+                config.paletteType = PALETTE_SINE;
+            }
+        } else if (arg == "-coloring" && i + 1 < argc) {
+            std::string name = argv[++i];
+            config.coloring = -1;
+            for (int k = COLORING_ITER; k <= COLORING_SMOOTH; ++k) {
+                if (name == coloringNames[k]) config.coloring = k;
+            }
+            if (config.coloring < 0) {
+                std::cerr << "Unknown coloring '" << name << "', using iter\n";
+                config.coloring = COLORING_ITER;
+            }
+        } else if (arg == "-device" && i + 1 < argc) {
+            std::string name = argv[++i];
+            config.device = -1;
+            for (int k = DEVICE_CPU; k <= DEVICE_GPU; ++k) {
+                if (name == deviceNames[k]) config.device = k;
+            }
+            if (config.device < 0) {
+                std::cerr << "Unknown device '" << name << "', using cpu\n";
+                config.device = DEVICE_CPU;
+            }
+        } else if (arg == "-field") {
+            config.saveField = true; // Keep the escape counts for recoloring
+        } else if (arg == "-stats" && i + 1 < argc) {
+            std::string name = argv[++i];
+            config.statsFormat = -1;
+            for (int k = STATS_OFF; k <= STATS_CSV; ++k) {
+                if (name == statsFormatNames[k]) config.statsFormat = k;
+            }
+            if (config.statsFormat < 0) {
+                std::cerr << "Unknown statistics format '" << name << "', using json\n";
+                config.statsFormat = STATS_JSON;
+            }
+        } else if (arg == "-nocardioid") {
+            config.interiorCheck = false; // Iterate every sample, e.g. for benchmarking the kernels
+        } else if (arg == "-noperiodicity") {
+            config.periodicity = false; // Run interior orbits all the way to max_iter
+        } else if (arg == "-fmt" && i + 1 < argc) {
+            std::string fmt = argv[++i];
+            if (fmt == "p3") {
+                config.format = FORMAT_P3;
+            } else if (fmt == "p6") {
+                config.format = FORMAT_P6;
+            } else {
+                std::cerr << "Unknown image format '" << fmt << "', using p6\n";
+                config.format = FORMAT_P6;
+            }
+        } else if (arg == "-io" && i + 1 < argc) {
+            std::string mode = argv[++i];
+            if (mode == "gather") {
+                config.ioMode = IO_GATHER;
+            } else if (mode == "mpiio") {
+                config.ioMode = IO_MPIIO;
+            } else if (mode == "stream") {
+                config.ioMode = IO_STREAM;
+            } else {
+                std::cerr << "Unknown output mode '" << mode << "', using gather\n";
+                config.ioMode = IO_GATHER;
+            }
         }
     }
 
+    // In batch mode the zoom changes from frame to frame, so auto is resolved per frame
+    if (config.deepMode == DEEP_AUTO && !animation.batch) {
+        config.deepMode = usePerturbation(config, config.center_x, config.center_y, config.zoom) ? DEEP_ON : DEEP_OFF;
+    }
+
+    // Adaptive supersampling picks the pixels to supersample by their colors, which a recolor changes
+    if (config.saveField && config.aaMode == AA_ADAPTIVE && config.aaSamples > 1) {
+        std::cerr << "The escape field needs every sample, using -aamode full\n";
+        config.aaMode = AA_FULL;
+    }
+
+    // The samples of a pixel form an aaSide x aaSide grid, so only square counts can be honored
+    int aaSide = static_cast<int>(std::sqrt(static_cast<double>(config.aaSamples)));
+    if (aaSide * aaSide != config.aaSamples) {
+        std::cerr << "AA samples " << config.aaSamples << " is not a square, using " << aaSide * aaSide << "\n";
+        config.aaSamples = aaSide * aaSide;
+    }
+
+    const char *schedNames[] = {"static", "cyclic", "dynamic"};
+
     // Print a summary of the conditions being used for this run
     std::cout << "\n=== Mandelbrot Set Generation Conditions ===\n";
     std::cout << std::left << std::setw(20) << "Output Filename:" << filename << "\n";
-    std::cout << std::left << std::setw(20) << "Max Iterations:" << max_iter << "\n";
-    std::cout << std::left << std::setw(20) << "Center X:" << center_x << "\n";
-    std::cout << std::left << std::setw(20) << "Center Y:" << center_y << "\n";
-    std::cout << std::left << std::setw(20) << "Zoom Level:" << zoom << "\n";
-    std::cout << std::left << std::setw(20) << "AA Samples:" << aaSamples << "\n";
+    std::cout << std::left << std::setw(20) << "Image Size:" << config.width << "x" << config.height << "\n";
+    std::cout << std::left << std::setw(20) << "Max Iterations:" << config.max_iter << "\n";
+    std::cout << std::left << std::setw(20) << "Center X:" << config.center_x << "\n";
+    std::cout << std::left << std::setw(20) << "Center Y:" << config.center_y << "\n";
+    std::cout << std::left << std::setw(20) << "Zoom Level:" << config.zoom << "\n";
+    if (animation.batch) {
+        std::cout << std::left << std::setw(20) << "Batch Keyframes:" << (animation.keyframeFile.empty() ? "path from the view above to -x1/-y1/-z1" : animation.keyframeFile) << "\n";
+    }
+    std::cout << std::left << std::setw(20) << "AA Samples:" << config.aaSamples << "\n";
+    std::cout << std::left << std::setw(20) << "AA Mode:" << aaModeNames[config.aaMode];
+    if (config.aaMode == AA_ADAPTIVE) std::cout << " (threshold " << config.aaThreshold << ")";
+    std::cout << "\n";
+    std::cout << std::left << std::setw(20) << "Scheduling:" << schedNames[config.sched];
+    if ((config.sched == SCHED_DYNAMIC || config.ioMode == IO_STREAM) && config.chunkRows > 0) std::cout << " (" << config.chunkRows << " rows per chunk)";
+    std::cout << "\n";
+    std::cout << std::left << std::setw(20) << "Tile Size:" << config.tileSize << "x" << config.tileSize << "\n";
+    std::cout << std::left << std::setw(20) << "Kernel:" << kernelNames[config.kernelType] << "\n";
+    std::cout << std::left << std::setw(20) << "Device:" << deviceNames[config.device] << "\n";
+    std::cout << std::left << std::setw(20) << "Engine:" << engineNames[config.engine] << "\n";
+    std::cout << std::left << std::setw(20) << "Unroll:" << config.unroll << "\n";
+    std::cout << std::left << std::setw(20) << "Precision:" << precisionNames[config.precisionType] << "\n";
+    std::cout << std::left << std::setw(20) << "Deep Zoom:" << (config.deepMode == DEEP_ON ? "on (perturbation)" : (config.deepMode == DEEP_AUTO ? "auto (per frame)" : "off")) << "\n";
+    std::cout << std::left << std::setw(20) << "Interior Check:" << (config.interiorCheck ? "on" : "off") << "\n";
+    std::cout << std::left << std::setw(20) << "Cycle Detection:" << (config.periodicity ? "on" : "off") << "\n";
+    std::cout << std::left << std::setw(20) << "Palette:" << paletteNames[config.paletteType] << "\n";
+    std::cout << std::left << std::setw(20) << "Coloring:" << coloringNames[config.coloring] << "\n";
+    std::cout << std::left << std::setw(20) << "Image Format:" << (config.format == FORMAT_P6 ? "P6 (binary)" : "P3 (ASCII)") << "\n";
+    if (config.ioMode == IO_MPIIO && config.format != FORMAT_P6) {
+        std::cerr << "Parallel output needs -fmt p6, writing from process 0 instead\n";
+        config.ioMode = IO_GATHER;
+    }
+    // Gathering holds the whole frame on process 0, so a P6 image past FRAME_BUDGET is streamed instead
+    if (config.ioMode == IO_GATHER && config.format == FORMAT_P6 && 3 * (size_t)config.width * config.height > FRAME_BUDGET) {
+        std::cerr << "A " << config.width << "x" << config.height << " frame is too large to gather on process 0, using -io stream\n";
+        config.ioMode = IO_STREAM;
+    }
+    if (config.saveField && config.ioMode != IO_MPIIO) {
+        std::cerr << "The escape field is written with MPI-IO and needs -io mpiio, not saving it\n";
+        config.saveField = false;
+    }
+    std::cout << std::left << std::setw(20) << "Output Mode:" << (config.ioMode == IO_MPIIO ? "MPI-IO" : (config.ioMode == IO_STREAM ? "stream" : "gather")) << "\n";
+    std::cout << std::left << std::setw(20) << "Escape Field:" << (config.saveField ? "on" : "off") << "\n";
+    std::cout << std::left << std::setw(20) << "Statistics:" << statsFormatNames[config.statsFormat];
+    if (config.statsFormat != STATS_OFF) std::cout << " (" << statsFilename(filename, config.statsFormat) << ")";
+    std::cout << "\n";
     std::cout << "============================================\n";
+
+    setConfigText(config.filename, filename);
+    setConfigText(config.center_x_text, center_x_text);
+    setConfigText(config.center_y_text, center_y_text);
 }
 
+// This function copies text into a fixed-size text field of RenderConfig, shortening it with a warning if
+// it does not fit.
+void setConfigText(char *field, const std::string &text) {
+    if (text.size() >= static_cast<size_t>(CONFIG_TEXT)) {
+        std::cerr << "'" << text.substr(0, 32) << "...' is longer than " << CONFIG_TEXT - 1 << " characters, shortening it\n";
+    }
+    size_t length = std::min(text.size(), static_cast<size_t>(CONFIG_TEXT - 1));
+    std::copy(text.begin(), text.begin() + length, field);
+    field[length] = '\0';
+}
 
-// This function computes the number of iterations it takes for a complex number to escape the Mandelbrot set.
-int computeMandelbrot(double real, double imag, int max_iter) {
-    std::complex<double> c(real, imag); // The complex number for which we compute the Mandelbrot iteration
-    std::complex<double> z(0, 0); // The initial value of z in the Mandelbrot iteration
+// This function puts the view and filename of a frame into the configuration.
+void setFrameView(const Frame &frame, RenderConfig &config) {
+    config.center_x = frame.center_x;
+    config.center_y = frame.center_y;
+    config.zoom = frame.zoom;
+    setConfigText(config.center_x_text, frame.center_x_text);
+    setConfigText(config.center_y_text, frame.center_y_text);
+    setConfigText(config.filename, frame.filename);
+}
+
+// This function builds the MPI datatype of RenderConfig, so the whole configuration travels in one MPI_Bcast.
+// Consecutive members of the same type form one block; the block lengths follow from the member offsets.
+MPI_Datatype makeConfigType() {
+    const int blocks = 5;
+    MPI_Aint offsets[blocks] = {offsetof(RenderConfig, width), offsetof(RenderConfig, center_x), offsetof(RenderConfig, aaSamples), offsetof(RenderConfig, interiorCheck), offsetof(RenderConfig, filename)};
+    int lengths[blocks] = {
+        static_cast<int>((offsetof(RenderConfig, center_x) - offsetof(RenderConfig, width)) / sizeof(int)), // width .. max_iter
+        3, // center_x, center_y, zoom
+        static_cast<int>((offsetof(RenderConfig, interiorCheck) - offsetof(RenderConfig, aaSamples)) / sizeof(int)), // aaSamples .. statsFormat
+        static_cast<int>((offsetof(RenderConfig, filename) - offsetof(RenderConfig, interiorCheck)) / sizeof(bool)), // interiorCheck .. saveField
+        3 * CONFIG_TEXT // filename, center_x_text, center_y_text
+    };
+    MPI_Datatype types[blocks] = {MPI_INT, MPI_DOUBLE, MPI_INT, MPI_CXX_BOOL, MPI_CHAR};
+    MPI_Datatype packed, configType;
+    MPI_Type_create_struct(blocks, lengths, offsets, types, &packed);
+    // Give the type the extent of the struct, trailing padding included
+    MPI_Type_create_resized(packed, 0, sizeof(RenderConfig), &configType);
+    MPI_Type_commit(&configType);
+    MPI_Type_free(&packed);
+    return configType;
+}
+
+// This function computes the escape counts of the listed cells of a sample grid as one batch.
+void sampleCells(const SampleGrid &grid, const std::vector<int> &cells) {
+    int count = cells.size();
+    std::vector<double> real(count), imag(count); // Sample coordinates of the batch
+    std::vector<int> iters(count); // Escape counts of the batch
+    std::vector<float> norms(grid.norms != NULL ? count : 0); // Escape |z|^2 of the batch, with smooth coloring
+    BatchScratch scratch; // Packed samples that still need the kernel
+    for (int c = 0; c < count; ++c) {
+        int i = cells[c] % grid.w;
+        int j = cells[c] / grid.w;
+        real[c] = (grid.x0 + i + grid.offX) * grid.scale + grid.move_x;
+        imag[c] = (grid.y0 + j + grid.offY) * grid.scale + grid.move_y;
+    }
+    computeSamples(grid, real.data(), imag.data(), count, iters.data(), grid.norms != NULL ? norms.data() : NULL, scratch);
+    for (int c = 0; c < count; ++c) {
+        grid.iters[cells[c]] = iters[c];
+    }
+    if (grid.norms != NULL) {
+        for (int c = 0; c < count; ++c) {
+            grid.norms[cells[c]] = norms[c];
+        }
+    }
+}
+
+// This function is the Mariani-Silver recursion over the rectangle of grid cells i0 <= i <= i1, j0 <= j <= j1,
+// whose border has already been computed. If every border cell has the same escape count, the interior takes
+// that count without being evaluated: the set and its escape-time bands are connected, so nothing different
+// can be enclosed. Otherwise the rectangle is cut into four by a computed middle row and column, and each part
+// recurses; large parts are OpenMP tasks so that an expensive region is shared among the threads.
+// With smooth coloring only interiors of the set are filled: the samples of a band share their escape count
+// but not their |z|^2, so the interior of a uniform band is evaluated in one batch instead.
+void marianiSilver(const SampleGrid &grid, int i0, int j0, int i1, int j1) {
+    const int w = grid.w;
+    const int *it = grid.iters;
+    int value = it[j0 * w + i0];
+    bool uniform = true;
+    for (int i = i0; i <= i1 && uniform; ++i) {
+        uniform = it[j0 * w + i] == value && it[j1 * w + i] == value;
+    }
+    for (int j = j0 + 1; j < j1 && uniform; ++j) {
+        uniform = it[j * w + i0] == value && it[j * w + i1] == value;
+    }
+    if (uniform && (grid.norms == NULL || value == grid.max_iter)) {
+        for (int j = j0 + 1; j < j1; ++j) {
+            std::fill(&grid.iters[j * w + i0 + 1], &grid.iters[j * w + i1], value);
+        }
+        if (ThreadStats *stats = threadStats(grid.stats)) {
+            stats->fillSkips += (uint64_t)std::max(0, i1 - i0 - 1) * std::max(0, j1 - j0 - 1);
+        }
+        return;
+    }
+
+    std::vector<int> cells;
+    if (uniform || i1 - i0 <= MS_MIN_SIDE || j1 - j0 <= MS_MIN_SIDE) {
+        // A smoothly colored band, or too small to be worth subdividing: evaluate the whole interior
+        for (int j = j0 + 1; j < j1; ++j) {
+            for (int i = i0 + 1; i < i1; ++i) {
+                cells.push_back(j * w + i);
+            }
+        }
+        sampleCells(grid, cells);
+        return;
+    }
+
+    // Compute the middle column and row, which become the shared borders of the four parts
+    int im = (i0 + i1) / 2;
+    int jm = (j0 + j1) / 2;
+    for (int j = j0 + 1; j < j1; ++j) {
+        cells.push_back(j * w + im);
+    }
+    for (int i = i0 + 1; i < i1; ++i) {
+        if (i != im) cells.push_back(jm * w + i);
+    }
+    sampleCells(grid, cells);
+
+    // The parts only write their own interiors, so they can run concurrently
+#ifdef _OPENMP
+    bool spawn = (i1 - i0) * (j1 - j0) > MS_TASK_CELLS;
+#endif
+    #pragma omp task if(spawn)
+    marianiSilver(grid, i0, j0, im, jm);
+    #pragma omp task if(spawn)
+    marianiSilver(grid, im, j0, i1, jm);
+    #pragma omp task if(spawn)
+    marianiSilver(grid, i0, jm, im, j1);
+    #pragma omp task if(spawn)
+    marianiSilver(grid, im, jm, i1, j1);
+    #pragma omp taskwait
+}
+
+// This function fills grid.iters with the escape counts of all grid.w x grid.h samples, and grid.norms, if set,
+// with their escape |z|^2. The brute-force engine evaluates each row as one batch; the Mariani-Silver engine
+// evaluates the border and recurses into it.
+void computeSampleGrid(int engine, const SampleGrid &grid) {
+    int w = grid.w, h = grid.h;
+    if (engine == ENGINE_MS && w > 2 && h > 2) {
+        std::vector<int> border;
+        for (int i = 0; i < w; ++i) {
+            border.push_back(i);
+            border.push_back((h - 1) * w + i);
+        }
+        for (int j = 1; j < h - 1; ++j) {
+            border.push_back(j * w);
+            border.push_back(j * w + w - 1);
+        }
+        sampleCells(grid, border);
+        marianiSilver(grid, 0, 0, w - 1, h - 1);
+        return;
+    }
+
+    std::vector<double> real(w), imag(w); // Sample coordinates of one row
+    BatchScratch scratch; // Packed samples that still need the kernel
+    for (int j = 0; j < h; ++j) {
+        for (int i = 0; i < w; ++i) {
+            real[i] = (grid.x0 + i + grid.offX) * grid.scale + grid.move_x;
+            imag[i] = (grid.y0 + j + grid.offY) * grid.scale + grid.move_y;
+        }
+        computeSamples(grid, real.data(), imag.data(), w, &grid.iters[j * w], grid.norms != NULL ? &grid.norms[j * w] : NULL, scratch);
+    }
+}
+
+// This function is computeTile for the adaptive anti-aliasing mode. Every pixel of the tile and of a one-pixel
+// apron around it is first sampled once, at the first offset of the aaSide x aaSide grid. A pixel whose color
+// differs from one of its four neighbors by more than aaThreshold in any channel lies on an edge and gets the
+// other aaSamples - 1 samples; every other pixel keeps its single sample. Equal escape counts always give equal
+// colors (nearly equal ones with smooth coloring), so flat regions and the interior of the set are never
+// supersampled.
+void computeTileAdaptive(int x0, int y0, int x1, int y1, const RenderConfig &config, const RenderState &state, uint8_t *rgb, int stride) {
+    int n = x1 - x0;
+    int w = n + 2; // Width of the tile plus its apron
+    int h = y1 - y0 + 2; // Height of the tile plus its apron
+    std::vector<double> real(w), imag(w); // Sample coordinates of one batch
+    std::vector<int> iters(w); // Escape counts of one batch
+    const bool smooth = config.coloring == COLORING_SMOOTH;
+    std::vector<float> norms(smooth ? w : 0); // Escape |z|^2 of one batch, with smooth coloring
+    BatchScratch scratch; // Packed samples that still need the kernel
+
+    // First pass: one sample per pixel, including the apron so that edge pixels are found at tile borders too
+    std::vector<int> first(w * h);
+    std::vector<float> firstNorms(smooth ? w * h : 0);
+    SampleGrid grid = makeSampleGrid(x0 - 1, y0 - 1, w, h, config, state, first.data(), smooth ? firstNorms.data() : NULL);
+    computeSampleGrid(config.engine, grid);
+
+    const int neighbors[4] = {-1, 1, -w, w}; // Offsets of the left, right, upper and lower neighbor in first
+    std::vector<int> edge(n); // Columns of the edge pixels in the current row
+    std::vector<int> samples(n); // Number of samples accumulated for each pixel of the current row
+    std::vector<double> totalR(n), totalG(n), totalB(n); // Color accumulators for the pixels of one row
+
+    // No task runs on this thread during the row loop, so its stats entry stays the same
+    ThreadStats *stats = threadStats(state.stats);
+    double computeBefore = (stats != NULL) ? stats->computeSeconds : 0.0;
+    StatsClock::time_point start = (stats != NULL) ? StatsClock::now() : StatsClock::time_point();
+    for (int y = y0; y < y1; ++y) {
+        const int *row = &first[(y - y0 + 1) * w + 1]; // row[i] is the first sample of pixel x0 + i
+        const float *rowNorms = smooth ? &firstNorms[(y - y0 + 1) * w + 1] : NULL;
+        int edges = 0;
+        for (int i = 0; i < n; ++i) {
+            int r, g, b;
+            mapSampleColor(row, rowNorms, i, config.max_iter, state.palette, r, g, b);
+            totalR[i] = r;
+            totalG[i] = g;
+            totalB[i] = b;
+            samples[i] = 1;
+            bool isEdge = false;
+            for (int k = 0; k < 4 && !isEdge; ++k) {
+                int nr, ng, nb;
+                mapSampleColor(row, rowNorms, i + neighbors[k], config.max_iter, state.palette, nr, ng, nb);
+                isEdge = std::abs(nr - r) > config.aaThreshold || std::abs(ng - g) > config.aaThreshold || std::abs(nb - b) > config.aaThreshold;
+            }
+            if (isEdge) {
+                edge[edges++] = i;
+                samples[i] = config.aaSamples;
+            }
+        }
+        if (stats != NULL) {
+            stats->adaptiveSkips += (uint64_t)(n - edges) * (config.aaSamples - 1);
+        }
+
+        // Second pass: the remaining grid offsets, batched over the edge pixels of the row
+        for (int dy = 0; dy < state.aaSide && edges > 0; ++dy) {
+            for (int dx = 0; dx < state.aaSide; ++dx) {
+                if (dx == 0 && dy == 0) {
+                    continue; // Taken in the first pass
+                }
+                for (int e = 0; e < edges; ++e) {
+                    real[e] = (x0 + edge[e] + (dx / (double)state.aaSide)) * grid.scale + grid.move_x;
+                    imag[e] = (y + (dy / (double)state.aaSide)) * grid.scale + grid.move_y;
+                }
+                computeSamples(grid, real.data(), imag.data(), edges, iters.data(), smooth ? norms.data() : NULL, scratch);
+                for (int e = 0; e < edges; ++e) {
+                    int r, g, b;
+                    mapSampleColor(iters.data(), smooth ? norms.data() : NULL, e, config.max_iter, state.palette, r, g, b);
+                    totalR[edge[e]] += r;
+                    totalG[edge[e]] += g;
+                    totalB[edge[e]] += b;
+                }
+            }
+        }
+
+        // Compute the average color values for each pixel and clamp to [0, 255]
+        for (int i = 0; i < n; ++i) {
+            int idx = (y - y0) * stride + i;
+            rgb[3 * idx] = static_cast<uint8_t>(std::min(255, static_cast<int>(totalR[i] / samples[i])));
+            rgb[3 * idx + 1] = static_cast<uint8_t>(std::min(255, static_cast<int>(totalG[i] / samples[i])));
+            rgb[3 * idx + 2] = static_cast<uint8_t>(std::min(255, static_cast<int>(totalB[i] / samples[i])));
+        }
+    }
+    if (stats != NULL) {
+        stats->colorSeconds += secondsSince(start) - (stats->computeSeconds - computeBefore);
+    }
+}
+
+// This function takes the aaSide x aaSide samples of every pixel of grid and adds their colors to the
+// accumulators. AASide is the grid side as a compile-time constant, so the offset loops are unrolled and the
+// offsets folded; AASide == 0 is the general version, which reads the side from aaSide. If field is given, the
+// escape counts are also stored there, side * side per pixel, for pixel rows stride pixels apart, and if fieldNorms
+// is given their escape |z|^2 in the same layout.
+template <int AASide>
+void accumulateSamples(int aaSide, int engine, SampleGrid &grid, const uint8_t *palette, double *totalR, double *totalG, double *totalB, int *field, float *fieldNorms, int stride) {
+    const int side = (AASide > 0) ? AASide : aaSide;
+    const int count = grid.w * grid.h;
+    for (int dy = 0; dy < side; ++dy) {
+        for (int dx = 0; dx < side; ++dx) {
+            // Compute how many iterations it takes for this sample of every pixel to escape
+            grid.offX = dx / (double)side;
+            grid.offY = dy / (double)side;
+            computeSampleGrid(engine, grid);
+            StatsTimer timer(grid.stats != NULL ? &threadStats(grid.stats)->colorSeconds : NULL);
+            if (field != NULL) {
+                for (int p = 0; p < count; ++p) {
+                    size_t k = ((size_t)(p / grid.w) * stride + p % grid.w) * side * side + dy * side + dx;
+                    field[k] = grid.iters[p];
+                    if (fieldNorms != NULL) {
+                        fieldNorms[k] = grid.norms[p];
+                    }
+                }
+            }
+            // Map the iteration counts to colors with the palette table and accumulate them
+            for (int p = 0; p < count; ++p) {
+                int r, g, b;
+                mapSampleColor(grid.iters, grid.norms, p, grid.max_iter, palette, r, g, b);
+                totalR[p] += r;
+                totalG[p] += g;
+                totalB[p] += b;
+            }
+        }
+    }
+}
+
+// This function computes the pixels x0 <= x < x1, y0 <= y < y1, averaging the anti-aliasing samples of every pixel
+// (or, in adaptive mode, of the pixels computeTileAdaptive finds on an edge).
+// The rgb pointer points at pixel (x0, y0) of an interleaved 8-bit RGB frame whose rows are stride pixels apart;
+// field, if given, points at the escape counts of the same pixel in an escape field laid out the same way, and
+// fieldNorms, if given, at their escape |z|^2.
+// For each anti-aliasing offset the escape counts of the whole tile are computed by the selected engine.
+void computeTile(int x0, int y0, int x1, int y1, const RenderConfig &config, const RenderState &state, uint8_t *rgb, int stride, int *field, float *fieldNorms) {
+    if (config.aaMode == AA_ADAPTIVE && config.aaSamples > 1) {
+        computeTileAdaptive(x0, y0, x1, y1, config, state, rgb, stride);
+        return;
+    }
+    int n = x1 - x0;
+    int rows = y1 - y0;
+    std::vector<int> iters(n * rows); // Escape counts of one sample of every pixel
+    std::vector<float> norms(config.coloring == COLORING_SMOOTH ? n * rows : 0); // Their escape |z|^2, with smooth coloring
+    std::vector<double> totalR(n * rows), totalG(n * rows), totalB(n * rows); // Color accumulators for the pixels of the tile
+    SampleGrid grid = makeSampleGrid(x0, y0, n, rows, config, state, iters.data(), norms.empty() ? NULL : norms.data());
+
+    // Use the instantiation specialized for the grid side when there is one
+    switch (state.aaSide) {
+    case 1: accumulateSamples<1>(state.aaSide, config.engine, grid, state.palette, totalR.data(), totalG.data(), totalB.data(), field, fieldNorms, stride); break;
+    case 2: accumulateSamples<2>(state.aaSide, config.engine, grid, state.palette, totalR.data(), totalG.data(), totalB.data(), field, fieldNorms, stride); break;
+    case 3: accumulateSamples<3>(state.aaSide, config.engine, grid, state.palette, totalR.data(), totalG.data(), totalB.data(), field, fieldNorms, stride); break;
+    case 4: accumulateSamples<4>(state.aaSide, config.engine, grid, state.palette, totalR.data(), totalG.data(), totalB.data(), field, fieldNorms, stride); break;
+    default: accumulateSamples<0>(state.aaSide, config.engine, grid, state.palette, totalR.data(), totalG.data(), totalB.data(), field, fieldNorms, stride); break;
+    }
+    // Compute the average color values for each pixel and clamp to [0, 255]
+    StatsTimer timer(state.stats != NULL ? &threadStats(state.stats)->colorSeconds : NULL);
+    for (int j = 0; j < rows; ++j) {
+        for (int i = 0; i < n; ++i) {
+            int p = j * n + i;
+            int idx = j * stride + i;
+            rgb[3 * idx] = static_cast<uint8_t>(std::min(255, static_cast<int>(totalR[p] / config.aaSamples)));
+            rgb[3 * idx + 1] = static_cast<uint8_t>(std::min(255, static_cast<int>(totalG[p] / config.aaSamples)));
+            rgb[3 * idx + 2] = static_cast<uint8_t>(std::min(255, static_cast<int>(totalB[p] / config.aaSamples)));
+        }
+    }
+}
+
+// This function picks the OpenMP offload device for -device gpu. Process localRank of the localRanks on a node
+// gets device localRank modulo the devices present, so with one process per GPU each has its own. It returns -1,
+// and the CPU engines render, for -device cpu, when the program was built without MANDEL_OFFLOAD or the node has
+// no device (so one binary runs on every partition), and with -field, whose escape counts the device does not
+// send back. With report the fallback is explained on stderr.
+int chooseOffloadDevice(const RenderConfig &config, int localRank, int localRanks, bool report) {
+    if (config.device != DEVICE_GPU) {
+        return -1;
+    }
+    int devices = 0; // Offload devices of this node
+#ifdef MANDEL_OFFLOAD
+    devices = omp_get_num_devices();
+#else
+    if (report) std::cerr << "Built without offload support (-DMANDEL_OFFLOAD), using -device cpu\n";
+    return -1;
+#endif
+    if (config.saveField) {
+        if (report) std::cerr << "The escape field is computed on the CPU, using -device cpu\n";
+        return -1;
+    }
+    if (devices == 0) {
+        if (report) std::cerr << "No offload device found, using -device cpu\n";
+        return -1;
+    }
+    if (report && localRanks > devices) {
+        std::cerr << "Warning: " << localRanks << " processes per node share " << devices << " offload devices\n";
+    }
+    return localRank % devices;
+}
+
+#ifdef MANDEL_OFFLOAD
+// This function tells whether the rows of the current frame are rendered by renderRowsDevice. The device
+// iterates in double precision only, so deep-zoom frames and views that need double-double stay on the CPU.
+bool frameOnDevice(const RenderConfig &config, const RenderState &state) {
+    if (state.device < 0 || state.orbit != NULL) {
+        return false;
+    }
+    return choosePrecision(state.precision.precision, 0, 0, config.width, config.height, state.scale, state.move_x, state.move_y, config.max_iter) != PRECISION_DD;
+}
+
+// This function is the escape-time loop of the offload device: computeMandelbrotPeriodic<double>, or with
+// periodicity false computeMandelbrot<double>, at Unroll = 1, written out without the templates and their
+// tolerance table so that the device compiler only has to build plain code. It stores the escape |z|^2 in *norm.
+int computeMandelbrotDevice(double real, double imag, int max_iter, bool periodicity, double tolerance, float *norm) {
+    double zr = 0.0, zi = 0.0; // The initial value of z in the Mandelbrot iteration
+    double savedR = 0.0, savedI = 0.0; // Orbit point the following iterations are compared against
+    int steps = 0, interval = 1; // Iterations since z was saved, and until it is saved again
     int n = 0; // Iteration counter
-    // Iterate until |z| > 2 (escaped) or we reach the maximum number of iterations
-    while (abs(z) <= 2.0 && n < max_iter) {
-        z = z*z + c;
+    while (zr * zr + zi * zi <= 4.0 && n < max_iter) {
+        double zr2 = zr * zr;
+        double zi2 = zi * zi;
+        zi = 2.0 * zr * zi + imag;
+        zr = zr2 - zi2 + real;
         ++n;
+        if (!periodicity) {
+            continue;
+        }
+        if (std::fabs(zr - savedR) < tolerance && std::fabs(zi - savedI) < tolerance) {
+            return max_iter; // The orbit repeats
+        }
+        if (++steps == interval) {
+            savedR = zr;
+            savedI = zi;
+            steps = 0;
+            interval *= 2;
+        }
+    }
+    *norm = static_cast<float>(zr * zr + zi * zi);
+    return n;
+}
+
+// This function renders the rows firstRow, firstRow + rowStep, ... (numRows of them) into consecutive rows of rgb
+// on offload device state.device, in a single target region: one device thread per pixel iterates its
+// aaSide x aaSide samples, colors them with the palette and averages them as computeTile does. The palette is
+// copied to the device and only the packed 8-bit RGB rows come back. Every sample is computed: the engine and
+// adaptive anti-aliasing only save work on the CPU. With -stats the work is counted as that of the calling thread.
+void renderRowsDevice(int firstRow, int numRows, int rowStep, const RenderConfig &config, const RenderState &state, uint8_t *rgb) {
+    // The target region only sees scalars and the mapped arrays, not the structs
+    const int width = config.width;
+    const int max_iter = config.max_iter;
+    const int side = state.aaSide;
+    const int samples = config.aaSamples;
+    const double scale = state.scale, move_x = state.move_x, move_y = state.move_y;
+    const bool interiorCheck = config.interiorCheck;
+    const bool periodicity = config.periodicity;
+    const bool smooth = config.coloring == COLORING_SMOOTH;
+    const double tolerance = PERIOD_TOLERANCE;
+    const uint8_t *palette = state.palette;
+    const size_t paletteBytes = 3 * ((size_t)max_iter + 1);
+    const size_t pixels = (size_t)width * numRows;
+    uint64_t iterations = 0, interiorSamples = 0, cardioidSkips = 0; // Work of the samples, for -stats
+    StatsClock::time_point start = StatsClock::now();
+    #pragma omp target teams distribute parallel for device(state.device) map(to: palette[0:paletteBytes]) map(from: rgb[0:3 * pixels]) reduction(+: iterations, interiorSamples, cardioidSkips)
+    for (size_t p = 0; p < pixels; ++p) {
+        int x = p % width;
+        int y = firstRow + static_cast<int>(p / width) * rowStep;
+        double totalR = 0.0, totalG = 0.0, totalB = 0.0;
+        for (int dy = 0; dy < side; ++dy) {
+            for (int dx = 0; dx < side; ++dx) {
+                double real = (x + dx / (double)side) * scale + move_x;
+                double imag = (y + dy / (double)side) * scale + move_y;
+                int iter;
+                float norm = 0.0f;
+                if (interiorCheck && inCardioidOrBulb(real, imag)) {
+                    iter = max_iter;
+                    ++cardioidSkips;
+                } else {
+                    iter = computeMandelbrotDevice(real, imag, max_iter, periodicity, tolerance, &norm);
+                    iterations += iter;
+                    interiorSamples += (iter >= max_iter);
+                }
+                int r, g, b;
+                if (smooth) {
+                    mapColorSmooth(iter, norm, max_iter, palette, r, g, b);
+                } else {
+                    mapColor(iter, palette, r, g, b);
+                }
+                totalR += r;
+                totalG += g;
+                totalB += b;
+            }
+        }
+        int meanR = static_cast<int>(totalR / samples), meanG = static_cast<int>(totalG / samples), meanB = static_cast<int>(totalB / samples);
+        rgb[3 * p] = static_cast<uint8_t>(meanR < 255 ? meanR : 255);
+        rgb[3 * p + 1] = static_cast<uint8_t>(meanG < 255 ? meanG : 255);
+        rgb[3 * p + 2] = static_cast<uint8_t>(meanB < 255 ? meanB : 255);
+    }
+    if (ThreadStats *stats = threadStats(state.stats)) {
+        stats->computeSeconds += secondsSince(start);
+        stats->kernelSamples += pixels * samples - cardioidSkips;
+        stats->iterations += iterations;
+        stats->interiorSamples += interiorSamples;
+        stats->cardioidSkips += cardioidSkips;
+    }
+}
+#endif
+
+// This function renders the rows firstRow, firstRow + rowStep, ... (numRows of them) into consecutive rows
+// of the rgb frame buffer, and their escape counts into consecutive rows of field if it is given (and their
+// escape |z|^2 into fieldNorms, with smooth coloring). The rows are split into tileSize x tileSize tiles, each
+// an OpenMP task, so idle threads keep taking the remaining tiles. Without OpenMP the tiles run in order.
+void renderRows(int firstRow, int numRows, int rowStep, const RenderConfig &config, const RenderState &state, uint8_t *rgb, int *field, float *fieldNorms) {
+    const int width = config.width;
+    const size_t samples = config.aaSamples;
+    StatsTimer timer(phaseSeconds(state.stats, PHASE_RENDER));
+#ifdef MANDEL_OFFLOAD
+    if (frameOnDevice(config, state)) {
+        renderRowsDevice(firstRow, numRows, rowStep, config, state, rgb);
+        return;
+    }
+#endif
+    #pragma omp parallel
+    {
+        #pragma omp single
+        {
+            for (int k0 = 0; k0 < numRows; k0 += config.tileSize) {
+                for (int tx = 0; tx < width; tx += config.tileSize) {
+                    #pragma omp task firstprivate(k0, tx)
+                    {
+                        int k1 = std::min(k0 + config.tileSize, numRows);
+                        int tx1 = std::min(tx + config.tileSize, width);
+                        if (rowStep == 1) {
+                            int y = firstRow + k0;
+                            computeTile(tx, y, tx1, y + k1 - k0, config, state, &rgb[3 * ((size_t)k0 * width + tx)], width, field ? &field[samples * ((size_t)k0 * width + tx)] : NULL, fieldNorms ? &fieldNorms[samples * ((size_t)k0 * width + tx)] : NULL);
+                        } else {
+                            // Rows of the tile are not contiguous in the image, so compute them one by one
+                            for (int k = k0; k < k1; ++k) {
+                                int y = firstRow + k * rowStep;
+                                computeTile(tx, y, tx1, y + 1, config, state, &rgb[3 * ((size_t)k * width + tx)], width, field ? &field[samples * ((size_t)k * width + tx)] : NULL, fieldNorms ? &fieldNorms[samples * ((size_t)k * width + tx)] : NULL);
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+// This function picks the OpenMP team size for each process. An explicit -t or OMP_NUM_THREADS wins;
+// otherwise the node's cores are divided among the processes running on it, so that one rank per node
+// or per socket gets a full team and flat MPI runs stay at one thread per rank.
+int chooseThreadsPerRank(int numThreads, int localRanks) {
+#ifdef _OPENMP
+    if (numThreads > 0) {
+        return numThreads;
+    }
+    if (getenv("OMP_NUM_THREADS") != NULL) {
+        return omp_get_max_threads();
+    }
+    int nodeCores = std::thread::hardware_concurrency();
+    int threads = std::max(1, nodeCores / localRanks);
+    // Never exceed the cores this process is allowed to run on (e.g. under Slurm CPU binding)
+    return std::min(threads, omp_get_num_procs());
+#else
+    (void)numThreads; // Without OpenMP every process runs one thread
+    (void)localRanks;
+    return 1;
+#endif
+}
+
+// This function runs on process 0 in dynamic mode. It hands out chunks of rows to whichever
+// worker asks next and receives the finished chunks straight into the frame buffer. all_rgb is
+// NULL when the workers write the file themselves and only report that a chunk is done.
+// In stream mode out is the P6 file and all_rgb is NULL: each chunk is received into a chunk buffer
+// and written to the file once the worker has new work, so process 0 never holds the whole image.
+// With -stats (stats given) waiting for and talking to the workers counts as gathering.
+void runDynamicMaster(const RenderConfig &config, int size, MPI_Datatype pixelType, uint8_t *all_rgb, MPI_File *out, RunStats *stats) {
+    const int width = config.width;
+    std::vector<int> assigned_row(size, 0); // First row of the chunk each worker is computing
+    std::vector<int> assigned_rows(size, 0); // Number of rows in that chunk (0 before the first assignment)
+    int next_row = 0; // First row that has not been handed out yet
+    int active_workers = size - 1; // Workers that have not been told to stop
+    std::vector<uint8_t> chunk((all_rgb == NULL && out != NULL) ? 3 * (size_t)config.chunkRows * width : 0); // Stream mode receive buffer
+
+    while (active_workers > 0) {
+        // Wait for any worker to return a chunk (or to send its first, empty request)
+        StatsClock::time_point start = StatsClock::now();
+        MPI_Status status;
+        MPI_Probe(MPI_ANY_SOURCE, TAG_RESULT, MPI_COMM_WORLD, &status);
+        int worker = status.MPI_SOURCE;
+
+        // The master knows which rows it gave this worker, so the pixels go directly to their place in the image
+        uint8_t *pixels = NULL;
+        if (assigned_rows[worker] > 0) {
+            pixels = (all_rgb != NULL) ? &all_rgb[3 * (size_t)assigned_row[worker] * width] : (out != NULL ? chunk.data() : NULL);
+        }
+        if (pixels != NULL) {
+            MPI_Recv(pixels, assigned_rows[worker] * width, pixelType, worker, TAG_RESULT, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+        } else {
+            MPI_Recv(NULL, 0, pixelType, worker, TAG_RESULT, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+        }
+
+        // Hand out the next chunk, or tell the worker to stop once all rows are assigned
+        int assignment[2] = {next_row, std::min(config.chunkRows, config.height - next_row)};
+        MPI_Send(assignment, 2, MPI_INT, worker, TAG_ASSIGN, MPI_COMM_WORLD);
+        if (stats != NULL) {
+            stats->seconds[PHASE_GATHER] += secondsSince(start);
+        }
+        if (out != NULL && pixels != NULL) {
+            StatsTimer timer(phaseSeconds(stats, PHASE_WRITE));
+            writeRowsMPIIO(*out, width, config.height, assigned_row[worker], assigned_rows[worker], 1, pixels, false);
+        }
+        assigned_row[worker] = assignment[0];
+        assigned_rows[worker] = assignment[1];
+        if (assignment[1] > 0) {
+            next_row += assignment[1];
+        } else {
+            --active_workers;
+        }
+    }
+}
+
+// This function runs on every process except 0 in dynamic mode. It requests chunks of rows
+// from process 0, computes them and sends them back until no rows are left. When fh is given
+// the worker writes each chunk into the shared file itself and only reports that it is done.
+void runDynamicWorker(const RenderConfig &config, const RenderState &state, MPI_Datatype pixelType, MPI_File *fh, MPI_File *fieldFh) {
+    const int width = config.width;
+    std::vector<uint8_t> rgb(3 * (size_t)config.chunkRows * width);
+    std::vector<int> field(fieldFh != NULL ? (size_t)config.aaSamples * config.chunkRows * width : 0); // Escape counts of the chunk
+    bool saveNorms = fieldFh != NULL && config.coloring == COLORING_SMOOTH;
+    std::vector<float> fieldNorms(saveNorms ? field.size() : 0); // Their escape |z|^2, with smooth coloring
+    double *gatherSeconds = phaseSeconds(state.stats, PHASE_GATHER);
+    // The first message is an empty result, which the master treats as a work request
+    MPI_Send(NULL, 0, pixelType, 0, TAG_RESULT, MPI_COMM_WORLD);
+
+    while (true) {
+        int assignment[2];
+        {
+            StatsTimer timer(gatherSeconds);
+            MPI_Recv(assignment, 2, MPI_INT, 0, TAG_ASSIGN, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+        }
+        int first_row = assignment[0];
+        int num_rows = assignment[1];
+        if (num_rows == 0) {
+            break; // No rows left
+        }
+
+        // Compute the chunk into the frame buffer and return it
+        renderRows(first_row, num_rows, 1, config, state, rgb.data(), fieldFh != NULL ? field.data() : NULL, saveNorms ? fieldNorms.data() : NULL);
+        if (fh != NULL) {
+            // Chunks finish in any order, so each one is an independent write at its own offset
+            {
+                StatsTimer timer(phaseSeconds(state.stats, PHASE_WRITE));
+                writeRowsMPIIO(*fh, width, config.height, first_row, num_rows, 1, rgb.data(), false);
+                if (fieldFh != NULL) {
+                    writeFieldRowsMPIIO(*fieldFh, fieldCountBytes(config.max_iter), config.aaSamples * width, first_row, num_rows, 1, field.data(), saveNorms ? fieldNorms.data() : NULL, false);
+                }
+            }
+            MPI_Send(NULL, 0, pixelType, 0, TAG_RESULT, MPI_COMM_WORLD);
+        } else {
+            StatsTimer timer(gatherSeconds);
+            MPI_Send(rgb.data(), num_rows * width, pixelType, 0, TAG_RESULT, MPI_COMM_WORLD);
+        }
     }
-    return n; // Return the number of iterations
 }
 
-// This function maps an iteration count to a color using a sinusoidal function.
-void mapColor(int iter, int max_iter, int &r, int &g, int &b) {
-    if (iter == max_iter) {
-        // If the point is in the Mandelbrot set, color it black
-        r = g = b = 0;
+// This function returns the rows a process renders with the static or cyclic schedule: firstRow,
+// firstRow + rowStep, ..., numRows of them. Static bands are height / size rows, the last one taking the rest.
+void localRows(int sched, int height, int rank, int size, int &firstRow, int &numRows, int &rowStep) {
+    if (sched == SCHED_CYCLIC) {
+        firstRow = rank;
+        numRows = (height - rank + size - 1) / size;
+        rowStep = size;
     } else {
-        // Otherwise, compute a color based on the iteration count
-        double frequency = 0.1;
-        r = static_cast<int>(sin(frequency * iter + 0) * 127 + 128);
-        g = static_cast<int>(sin(frequency * iter + 2) * 127 + 128);
-        b = static_cast<int>(sin(frequency * iter + 4) * 127 + 128);
+        firstRow = rank * (height / size);
+        numRows = (rank == size - 1) ? height - firstRow : height / size;
+        rowStep = 1;
+    }
+}
+
+// This function puts chunk number chunk of process source's rows (stored consecutively in pixels) into the
+// output in stream mode: straight into the P6 file when out is given, else into the frame buffer. With -stats
+// (stats given) the time counts as writing or gathering respectively.
+void placeChunk(const RenderConfig &config, int size, int source, int chunk, const uint8_t *pixels, uint8_t *frameRgb, MPI_File *out, RunStats *stats) {
+    const int width = config.width;
+    StatsTimer timer(phaseSeconds(stats, out != NULL ? PHASE_WRITE : PHASE_GATHER));
+    int firstRow, numRows, rowStep;
+    localRows(config.sched, config.height, source, size, firstRow, numRows, rowStep);
+    int k0 = chunk * config.chunkRows;
+    int n = std::min(config.chunkRows, numRows - k0);
+    int y0 = firstRow + k0 * rowStep;
+    if (out != NULL) {
+        writeRowsMPIIO(*out, width, config.height, y0, n, rowStep, pixels, false);
+    } else {
+        for (int k = 0; k < n; ++k) {
+            std::copy(pixels + 3 * (size_t)k * width, pixels + 3 * (size_t)(k + 1) * width, &frameRgb[3 * (size_t)(y0 + k * rowStep) * width]);
+        }
+    }
+}
+
+// This function runs on every process in stream mode with the static and cyclic schedules. Each process renders
+// its rows chunkRows at a time, and the other processes send every finished chunk to process 0 with MPI_Isend
+// while they compute the next ones. The chunks are rendered into a ring of STREAM_BUFFERS buffers, each reused
+// once its send has completed, so memory stays bounded however large the image. Process 0 places its own chunks
+// and, between them, the chunks that have arrived; then it waits for the rest. Each chunk's tag is TAG_CHUNK
+// plus its number, so process 0 knows where the rows go from the tag and the sender alone.
+void streamRows(int rank, int size, const RenderConfig &config, const RenderState &state, MPI_Datatype pixelType, uint8_t *frameRgb, MPI_File *out) {
+    const int width = config.width;
+    const int chunkRows = config.chunkRows;
+    const size_t chunkBytes = 3 * (size_t)chunkRows * width;
+    int firstRow, numRows, rowStep;
+    localRows(config.sched, config.height, rank, size, firstRow, numRows, rowStep);
+
+    // Process 0 counts the chunks it is going to receive and keeps a buffer for them
+    int pending = 0;
+    std::vector<uint8_t> incoming;
+    if (rank == 0) {
+        for (int r = 1; r < size; ++r) {
+            int first, rows, step;
+            localRows(config.sched, config.height, r, size, first, rows, step);
+            pending += (rows + chunkRows - 1) / chunkRows;
+        }
+        incoming.resize(chunkBytes);
+    }
+    std::vector<uint8_t> buffers((rank == 0 ? 1 : STREAM_BUFFERS) * chunkBytes);
+    std::vector<MPI_Request> requests(STREAM_BUFFERS, MPI_REQUEST_NULL);
+    double *gatherSeconds = phaseSeconds(state.stats, PHASE_GATHER);
+
+    for (int k0 = 0; k0 < numRows; k0 += chunkRows) {
+        int n = std::min(chunkRows, numRows - k0);
+        int slot = (rank == 0) ? 0 : (k0 / chunkRows) % STREAM_BUFFERS;
+        // The buffer stays untouched until the send of the chunk rendered into it earlier completes
+        {
+            StatsTimer timer(gatherSeconds);
+            MPI_Wait(&requests[slot], MPI_STATUS_IGNORE);
+        }
+        uint8_t *chunk = &buffers[slot * chunkBytes];
+        renderRows(firstRow + k0 * rowStep, n, rowStep, config, state, chunk, NULL, NULL);
+        if (rank != 0) {
+            StatsTimer timer(gatherSeconds);
+            MPI_Isend(chunk, n * width, pixelType, 0, TAG_CHUNK + k0 / chunkRows, MPI_COMM_WORLD, &requests[slot]);
+            continue;
+        }
+        placeChunk(config, size, 0, k0 / chunkRows, chunk, frameRgb, out, state.stats);
+        // Take whatever has arrived while this chunk was computed
+        while (pending > 0) {
+            int arrived;
+            MPI_Status status;
+            {
+                StatsTimer timer(gatherSeconds);
+                MPI_Iprobe(MPI_ANY_SOURCE, MPI_ANY_TAG, MPI_COMM_WORLD, &arrived, &status);
+                if (arrived) {
+                    MPI_Recv(incoming.data(), chunkRows * width, pixelType, status.MPI_SOURCE, status.MPI_TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+                }
+            }
+            if (!arrived) {
+                break;
+            }
+            placeChunk(config, size, status.MPI_SOURCE, status.MPI_TAG - TAG_CHUNK, incoming.data(), frameRgb, out, state.stats);
+            --pending;
+        }
+    }
+
+    if (rank != 0) {
+        StatsTimer timer(gatherSeconds);
+        MPI_Waitall(requests.size(), requests.data(), MPI_STATUSES_IGNORE);
+        return;
+    }
+    // The rest of the chunks, in whatever order they finish
+    for (; pending > 0; --pending) {
+        MPI_Status status;
+        {
+            StatsTimer timer(gatherSeconds);
+            MPI_Recv(incoming.data(), chunkRows * width, pixelType, MPI_ANY_SOURCE, MPI_ANY_TAG, MPI_COMM_WORLD, &status);
+        }
+        placeChunk(config, size, status.MPI_SOURCE, status.MPI_TAG - TAG_CHUNK, incoming.data(), frameRgb, out, state.stats);
+    }
+}
+
+// This function renders this process's rows of the static or cyclic schedule in parallel output mode and writes
+// them into the shared P6 file fh, a strip of chooseStripRows rows at a time, so a process never holds more than
+// one strip however large the image. The writes are collective, so every process makes as many of them as the
+// process with the most rows, with empty strips once its own rows are done. With fieldFh the escape counts of
+// each strip are written into that escape-field file the same way.
+void renderStrips(int rank, int size, const RenderConfig &config, const RenderState &state, MPI_File fh, MPI_File *fieldFh) {
+    int firstRow, numRows, rowStep;
+    localRows(config.sched, config.height, rank, size, firstRow, numRows, rowStep);
+    int maxRows = 0;
+    for (int r = 0; r < size; ++r) {
+        int first, rows, step;
+        localRows(config.sched, config.height, r, size, first, rows, step);
+        maxRows = std::max(maxRows, rows);
+    }
+    int stripRows = std::max(1, std::min(chooseStripRows(config), maxRows));
+    std::vector<uint8_t> rgb(3 * (size_t)stripRows * config.width);
+    std::vector<int> field(fieldFh != NULL ? (size_t)config.aaSamples * stripRows * config.width : 0);
+    bool saveNorms = fieldFh != NULL && config.coloring == COLORING_SMOOTH;
+    std::vector<float> fieldNorms(saveNorms ? field.size() : 0); // Escape |z|^2 of the field, with smooth coloring
+    for (int k0 = 0; k0 < maxRows; k0 += stripRows) {
+        int n = std::max(0, std::min(stripRows, numRows - k0));
+        if (n > 0) {
+            renderRows(firstRow + k0 * rowStep, n, rowStep, config, state, rgb.data(), fieldFh != NULL ? field.data() : NULL, saveNorms ? fieldNorms.data() : NULL);
+        }
+        // The writes are collective, so their time includes waiting for the processes still rendering
+        StatsTimer timer(phaseSeconds(state.stats, PHASE_WRITE));
+        writeRowsMPIIO(fh, config.width, config.height, firstRow + k0 * rowStep, n, rowStep, rgb.data(), true);
+        if (fieldFh != NULL) {
+            writeFieldRowsMPIIO(*fieldFh, fieldCountBytes(config.max_iter), config.aaSamples * config.width, firstRow + k0 * rowStep, n, rowStep, field.data(), saveNorms ? fieldNorms.data() : NULL, true);
+        }
+    }
+}
+
+// Error-free transformations behind the double-double arithmetic (Dekker and Knuth). They rely on every
+// operation being rounded separately, so the file must not be compiled with FMA contraction.
+DoubleDouble twoSum(double a, double b) {
+    double s = a + b;
+    double bb = s - a;
+    return DoubleDouble(s, (a - (s - bb)) + (b - bb));
+}
+
+DoubleDouble quickTwoSum(double a, double b) {
+    double s = a + b;
+    return DoubleDouble(s, b - (s - a));
+}
+
+DoubleDouble twoProd(double a, double b) {
+    const double splitter = 134217729.0; // 2^27 + 1
+    double p = a * b;
+    double ta = splitter * a, tb = splitter * b;
+    double ah = ta - (ta - a), al = a - ah;
+    double bh = tb - (tb - b), bl = b - bh;
+    return DoubleDouble(p, ((ah * bh - p) + ah * bl + al * bh) + al * bl);
+}
+
+DoubleDouble operator+(DoubleDouble a, DoubleDouble b) {
+    DoubleDouble s = twoSum(a.hi, b.hi);
+    DoubleDouble t = twoSum(a.lo, b.lo);
+    s = quickTwoSum(s.hi, s.lo + t.hi);
+    return quickTwoSum(s.hi, s.lo + t.lo);
+}
+
+DoubleDouble operator-(DoubleDouble a) {
+    return DoubleDouble(-a.hi, -a.lo);
+}
+
+DoubleDouble operator-(DoubleDouble a, DoubleDouble b) {
+    return a + (-b);
+}
+
+DoubleDouble operator*(DoubleDouble a, DoubleDouble b) {
+    DoubleDouble p = twoProd(a.hi, b.hi);
+    return quickTwoSum(p.hi, p.lo + (a.hi * b.lo + a.lo * b.hi));
+}
+
+bool operator<(DoubleDouble a, DoubleDouble b) {
+    return a.hi < b.hi || (a.hi == b.hi && a.lo < b.lo);
+}
+
+bool operator<=(DoubleDouble a, DoubleDouble b) {
+    return a.hi < b.hi || (a.hi == b.hi && a.lo <= b.lo);
+}
+
+DoubleDouble fabs(DoubleDouble a) {
+    return a.hi < 0.0 ? -a : a;
+}
+
+// Cycle-detection tolerance for each precision, about a thousand units of roundoff of |z| ~ 1
+template <> float periodTolerance<float>() { return PERIOD_TOLERANCE_FLOAT; }
+template <> double periodTolerance<double>() { return PERIOD_TOLERANCE; }
+template <> DoubleDouble periodTolerance<DoubleDouble>() { return DoubleDouble(PERIOD_TOLERANCE_DD); }
+
+// Rounding of each precision to float, in which the escape |z|^2 of a sample is kept for smooth coloring
+template <> float toFloat<float>(float x) { return x; }
+template <> float toFloat<double>(double x) { return static_cast<float>(x); }
+template <> float toFloat<DoubleDouble>(DoubleDouble x) { return static_cast<float>(x.hi); }
+
+// This function parses a decimal number into a double-double. The digits go through the fixed-point parser,
+// and the limbs, each exactly representable as a double, are summed from the least significant up.
+DoubleDouble doubleDoubleFromString(const std::string &text) {
+    const int limbs = 5; // 32 integer and 128 fraction bits, more than double-double holds
+    FixedPoint value = fixedFromString(text, limbs);
+    bool negative = value.limb.back() & 0x80000000u;
+    if (negative) fixedNegate(value);
+    DoubleDouble sum(0.0);
+    for (int k = 0; k < limbs; ++k) {
+        sum = sum + DoubleDouble(std::ldexp(static_cast<double>(value.limb[k]), 32 * (k - (limbs - 1))));
+    }
+    return negative ? -sum : sum;
+}
+
+// This function computes the number of iterations it takes for a complex number to escape the Mandelbrot set.
+// It compares |z|^2 against 4 instead of |z| against 2, which avoids a square root on every iteration,
+// and performs the same operations in the same order as one lane of the SIMD kernels below.
+// T is the scalar type the orbit is computed in: float, double or DoubleDouble. With Unroll > 1 the loop
+// runs blocks of Unroll iterations and tests for escape once per block: |z| only grows once it exceeds 2,
+// so an orbit that is inside after a block was inside throughout. The block in which the orbit escapes
+// is redone one step at a time, so the count is the same for every Unroll. If norm is given, the |z|^2 the
+// orbit escaped with is stored there for smooth coloring.
+template <typename T, int Unroll>
+int computeMandelbrot(T real, T imag, int max_iter, float *norm) {
+    T zr = T(0.0), zi = T(0.0); // The initial value of z in the Mandelbrot iteration
+    int n = 0; // Iteration counter
+    while (Unroll > 1 && n + Unroll <= max_iter) {
+        T zr0 = zr, zi0 = zi;
+        for (int u = 0; u < Unroll; ++u) {
+            T zr2 = zr * zr;
+            T zi2 = zi * zi;
+            zi = T(2.0) * zr * zi + imag;
+            zr = zr2 - zi2 + real;
+        }
+        if (!(zr * zr + zi * zi <= T(4.0))) {
+            zr = zr0;
+            zi = zi0;
+            break; // Escaped in this block
+        }
+        n += Unroll;
+    }
+    // Iterate until |z|^2 > 4 (escaped) or we reach the maximum number of iterations
+    while (zr * zr + zi * zi <= T(4.0) && n < max_iter) {
+        T zr2 = zr * zr;
+        T zi2 = zi * zi;
+        zi = T(2.0) * zr * zi + imag;
+        zr = zr2 - zi2 + real;
+        ++n;
+    }
+    if (norm != NULL) {
+        *norm = toFloat(zr * zr + zi * zi);
+    }
+    return n; // Return the number of iterations
+}
+
+// This function is computeMandelbrot with Brent-style cycle detection. z is saved after 1, 2, 4, 8, ...
+// further iterations (blocks, with Unroll > 1); if the orbit comes back to the saved value within
+// periodTolerance<T>() it has fallen into a cycle and will never escape, so the point is reported as
+// inside the set at once.
+template <typename T, int Unroll>
+int computeMandelbrotPeriodic(T real, T imag, int max_iter, float *norm) {
+    using std::fabs;
+    const T tolerance = periodTolerance<T>();
+    T zr = T(0.0), zi = T(0.0); // The initial value of z in the Mandelbrot iteration
+    T savedR = T(0.0), savedI = T(0.0); // Orbit point the following iterations are compared against
+    int steps = 0, interval = 1; // Iterations (or blocks) since z was saved, and until it is saved again
+    int n = 0; // Iteration counter
+    while (Unroll > 1 && n + Unroll <= max_iter) {
+        T zr0 = zr, zi0 = zi;
+        for (int u = 0; u < Unroll; ++u) {
+            T zr2 = zr * zr;
+            T zi2 = zi * zi;
+            zi = T(2.0) * zr * zi + imag;
+            zr = zr2 - zi2 + real;
+        }
+        if (!(zr * zr + zi * zi <= T(4.0))) {
+            zr = zr0;
+            zi = zi0;
+            break; // Escaped in this block
+        }
+        n += Unroll;
+        if (fabs(zr - savedR) < tolerance && fabs(zi - savedI) < tolerance) {
+            return max_iter; // The orbit repeats
+        }
+        if (++steps == interval) {
+            savedR = zr;
+            savedI = zi;
+            steps = 0;
+            interval *= 2;
+        }
+    }
+    while (zr * zr + zi * zi <= T(4.0) && n < max_iter) {
+        T zr2 = zr * zr;
+        T zi2 = zi * zi;
+        zi = T(2.0) * zr * zi + imag;
+        zr = zr2 - zi2 + real;
+        ++n;
+        if (Unroll > 1) {
+            continue; // Cycles are only checked at block boundaries
+        }
+        if (fabs(zr - savedR) < tolerance && fabs(zi - savedI) < tolerance) {
+            return max_iter; // The orbit repeats
+        }
+        if (++steps == interval) {
+            savedR = zr;
+            savedI = zi;
+            steps = 0;
+            interval *= 2;
+        }
+    }
+    if (norm != NULL) {
+        *norm = toFloat(zr * zr + zi * zi);
+    }
+    return n; // Return the number of iterations
+}
+
+// Scalar row-batch kernel: computes the escape counts of count samples one at a time in precision T.
+template <typename T, bool Periodicity, int Unroll>
+void computeMandelbrotBatchScalar(const double *real, const double *imag, int count, int max_iter, int *iters, float *norms) {
+    for (int i = 0; i < count; ++i) {
+        T cr = static_cast<T>(real[i]);
+        T ci = static_cast<T>(imag[i]);
+        float *norm = (norms != NULL) ? &norms[i] : NULL;
+        iters[i] = Periodicity ? computeMandelbrotPeriodic<T, Unroll>(cr, ci, max_iter, norm) : computeMandelbrot<T, Unroll>(cr, ci, max_iter, norm);
+    }
+}
+
+#ifdef MANDEL_X86_SIMD
+// AVX2 row-batch kernel: iterates 4 samples in lockstep. Lanes that have escaped are masked off and
+// stop counting; the group finishes when every lane has escaped or max_iter is reached. With Periodicity,
+// lanes whose orbit returns to the saved z are set to max_iter and masked off as well.
+// FMA is deliberately not enabled so the results match the scalar kernel bit for bit. With norms, each lane
+// keeps the |z|^2 it had when it was masked off; only the single steps pay for that, not the unrolled blocks.
+template <bool Periodicity, int Unroll>
+__attribute__((target("avx2")))
+void computeMandelbrotBatchAVX2(const double *real, const double *imag, int count, int max_iter, int *iters, float *norms) {
+    const __m256d four = _mm256_set1_pd(4.0);
+    const __m256d one = _mm256_set1_pd(1.0);
+    const __m256d unrolled = _mm256_set1_pd(Unroll);
+    const __m256d maxCount = _mm256_set1_pd(max_iter);
+    const __m256d tolerance = _mm256_set1_pd(PERIOD_TOLERANCE);
+    const __m256d signMask = _mm256_set1_pd(-0.0);
+    const bool smooth = norms != NULL;
+    for (int i = 0; i < count; i += 4) {
+        // Pad a partial last group with a point that escapes on the second iteration
+        double cr_in[4] = {4.0, 4.0, 4.0, 4.0}, ci_in[4] = {0.0, 0.0, 0.0, 0.0};
+        int lanes = std::min(4, count - i);
+        for (int l = 0; l < lanes; ++l) {
+            cr_in[l] = real[i + l];
+            ci_in[l] = imag[i + l];
+        }
+        __m256d cr = _mm256_loadu_pd(cr_in);
+        __m256d ci = _mm256_loadu_pd(ci_in);
+        __m256d zr = _mm256_setzero_pd();
+        __m256d zi = _mm256_setzero_pd();
+        __m256d savedR = _mm256_setzero_pd();
+        __m256d savedI = _mm256_setzero_pd();
+        int steps = 0, interval = 1; // The lanes run in lockstep, so they share the cycle-detection schedule
+        __m256d n = _mm256_setzero_pd(); // Per-lane iteration counters
+        __m256d norm = _mm256_setzero_pd(); // Per-lane |z|^2 at escape, kept with smooth coloring
+        __m256d active = _mm256_castsi256_pd(_mm256_set1_epi64x(-1)); // Lanes that have not escaped yet
+
+        int it = 0;
+        // With Unroll > 1, blocks of Unroll iterations run with one escape test at the end. |z| only grows
+        // once it exceeds 2, so a lane that is inside after the block was inside throughout it.
+        while (Unroll > 1 && it + Unroll <= max_iter) {
+            __m256d zr0 = zr, zi0 = zi;
+            for (int u = 0; u < Unroll; ++u) {
+                __m256d zr2 = _mm256_mul_pd(zr, zr);
+                __m256d zi2 = _mm256_mul_pd(zi, zi);
+                __m256d zrzi = _mm256_mul_pd(zr, zi);
+                zi = _mm256_add_pd(_mm256_add_pd(zrzi, zrzi), ci);
+                zr = _mm256_add_pd(_mm256_sub_pd(zr2, zi2), cr);
+            }
+            __m256d inside = _mm256_cmp_pd(_mm256_add_pd(_mm256_mul_pd(zr, zr), _mm256_mul_pd(zi, zi)), four, _CMP_LE_OQ);
+            if (_mm256_movemask_pd(_mm256_andnot_pd(inside, active)) != 0) {
+                // An active lane escaped in the block: redo it one step at a time to find the exact counts
+                zr = zr0;
+                zi = zi0;
+                for (int u = 0; u < Unroll; ++u) {
+                    __m256d zr2 = _mm256_mul_pd(zr, zr);
+                    __m256d zi2 = _mm256_mul_pd(zi, zi);
+                    __m256d mag = _mm256_add_pd(zr2, zi2);
+                    if (smooth) {
+                        norm = _mm256_blendv_pd(norm, mag, active); // An escaping lane keeps its first |z|^2 past 4
+                    }
+                    // A lane stays active while |z|^2 <= 4
+                    active = _mm256_and_pd(active, _mm256_cmp_pd(mag, four, _CMP_LE_OQ));
+                    if (_mm256_movemask_pd(active) == 0) {
+                        break;
+                    }
+                    n = _mm256_add_pd(n, _mm256_and_pd(active, one));
+                    __m256d zrzi = _mm256_mul_pd(zr, zi);
+                    zi = _mm256_add_pd(_mm256_add_pd(zrzi, zrzi), ci);
+                    zr = _mm256_add_pd(_mm256_sub_pd(zr2, zi2), cr);
+                }
+                if (_mm256_movemask_pd(active) == 0) {
+                    break; // All lanes escaped
+                }
+            } else {
+                n = _mm256_add_pd(n, _mm256_and_pd(active, unrolled));
+            }
+            it += Unroll;
+            if (Periodicity) {
+                // Cycle detection at block granularity; the saved point is taken every 1, 2, 4, ... blocks
+                __m256d dr = _mm256_andnot_pd(signMask, _mm256_sub_pd(zr, savedR));
+                __m256d di = _mm256_andnot_pd(signMask, _mm256_sub_pd(zi, savedI));
+                __m256d cycling = _mm256_and_pd(active, _mm256_and_pd(_mm256_cmp_pd(dr, tolerance, _CMP_LT_OQ), _mm256_cmp_pd(di, tolerance, _CMP_LT_OQ)));
+                n = _mm256_blendv_pd(n, maxCount, cycling);
+                active = _mm256_andnot_pd(cycling, active);
+                if (++steps == interval) {
+                    savedR = zr;
+                    savedI = zi;
+                    steps = 0;
+                    interval *= 2;
+                }
+                if (_mm256_movemask_pd(active) == 0) {
+                    break; // Every lane is cycling
+                }
+            }
+        }
+
+        // Single steps through the remaining iterations (all of them with Unroll == 1)
+        for (; it < max_iter; ++it) {
+            __m256d zr2 = _mm256_mul_pd(zr, zr);
+            __m256d zi2 = _mm256_mul_pd(zi, zi);
+            __m256d mag = _mm256_add_pd(zr2, zi2);
+            if (smooth) {
+                norm = _mm256_blendv_pd(norm, mag, active); // An escaping lane keeps its first |z|^2 past 4
+            }
+            // A lane stays active while |z|^2 <= 4
+            active = _mm256_and_pd(active, _mm256_cmp_pd(mag, four, _CMP_LE_OQ));
+            if (_mm256_movemask_pd(active) == 0) {
+                break; // All lanes escaped
+            }
+            n = _mm256_add_pd(n, _mm256_and_pd(active, one));
+            __m256d zrzi = _mm256_mul_pd(zr, zi);
+            zi = _mm256_add_pd(_mm256_add_pd(zrzi, zrzi), ci);
+            zr = _mm256_add_pd(_mm256_sub_pd(zr2, zi2), cr);
+
+            if (Periodicity && Unroll == 1) {
+                // |z - saved| below the tolerance in both components means the orbit is cycling
+                __m256d dr = _mm256_andnot_pd(signMask, _mm256_sub_pd(zr, savedR));
+                __m256d di = _mm256_andnot_pd(signMask, _mm256_sub_pd(zi, savedI));
+                __m256d cycling = _mm256_and_pd(active, _mm256_and_pd(_mm256_cmp_pd(dr, tolerance, _CMP_LT_OQ), _mm256_cmp_pd(di, tolerance, _CMP_LT_OQ)));
+                n = _mm256_blendv_pd(n, maxCount, cycling);
+                active = _mm256_andnot_pd(cycling, active);
+                if (++steps == interval) {
+                    savedR = zr;
+                    savedI = zi;
+                    steps = 0;
+                    interval *= 2;
+                }
+            }
+        }
+
+        double n_out[4];
+        _mm256_storeu_pd(n_out, n);
+        for (int l = 0; l < lanes; ++l) {
+            iters[i + l] = static_cast<int>(n_out[l]);
+        }
+        if (smooth) {
+            double norm_out[4];
+            _mm256_storeu_pd(norm_out, norm);
+            for (int l = 0; l < lanes; ++l) {
+                norms[i + l] = static_cast<float>(norm_out[l]);
+            }
+        }
+    }
+}
+
+// AVX-512 row-batch kernel: the same algorithm as the AVX2 kernel with 8 lanes and mask registers.
+// AVX-512F implies FMA, so contraction is switched off explicitly to keep the results bit-identical.
+template <bool Periodicity, int Unroll>
+__attribute__((target("avx512f"), optimize("fp-contract=off")))
+void computeMandelbrotBatchAVX512(const double *real, const double *imag, int count, int max_iter, int *iters, float *norms) {
+    const __m512d four = _mm512_set1_pd(4.0);
+    const __m512d one = _mm512_set1_pd(1.0);
+    const __m512d unrolled = _mm512_set1_pd(Unroll);
+    const __m512d maxCount = _mm512_set1_pd(max_iter);
+    const __m512d tolerance = _mm512_set1_pd(PERIOD_TOLERANCE);
+    const bool smooth = norms != NULL;
+    for (int i = 0; i < count; i += 8) {
+        // Lanes past the end of the batch start inactive
+        int lanes = std::min(8, count - i);
+        __mmask8 active = static_cast<__mmask8>((1u << lanes) - 1);
+        __m512d cr = _mm512_maskz_loadu_pd(active, real + i);
+        __m512d ci = _mm512_maskz_loadu_pd(active, imag + i);
+        __m512d zr = _mm512_setzero_pd();
+        __m512d zi = _mm512_setzero_pd();
+        __m512d savedR = _mm512_setzero_pd();
+        __m512d savedI = _mm512_setzero_pd();
+        int steps = 0, interval = 1; // The lanes run in lockstep, so they share the cycle-detection schedule
+        __m512d n = _mm512_setzero_pd(); // Per-lane iteration counters
+        __m512d norm = _mm512_setzero_pd(); // Per-lane |z|^2 at escape, kept with smooth coloring
+
+        int it = 0;
+        // With Unroll > 1, blocks of Unroll iterations run with one escape test at the end. |z| only grows
+        // once it exceeds 2, so a lane that is inside after the block was inside throughout it.
+        while (Unroll > 1 && it + Unroll <= max_iter) {
+            __m512d zr0 = zr, zi0 = zi;
+            for (int u = 0; u < Unroll; ++u) {
+                __m512d zr2 = _mm512_mul_pd(zr, zr);
+                __m512d zi2 = _mm512_mul_pd(zi, zi);
+                __m512d zrzi = _mm512_mul_pd(zr, zi);
+                zi = _mm512_add_pd(_mm512_add_pd(zrzi, zrzi), ci);
+                zr = _mm512_add_pd(_mm512_sub_pd(zr2, zi2), cr);
+            }
+            __mmask8 inside = _mm512_mask_cmp_pd_mask(active, _mm512_add_pd(_mm512_mul_pd(zr, zr), _mm512_mul_pd(zi, zi)), four, _CMP_LE_OQ);
+            if (inside != active) {
+                // An active lane escaped in the block: redo it one step at a time to find the exact counts
+                zr = zr0;
+                zi = zi0;
+                for (int u = 0; u < Unroll; ++u) {
+                    __m512d zr2 = _mm512_mul_pd(zr, zr);
+                    __m512d zi2 = _mm512_mul_pd(zi, zi);
+                    __m512d mag = _mm512_add_pd(zr2, zi2);
+                    if (smooth) {
+                        norm = _mm512_mask_mov_pd(norm, active, mag); // An escaping lane keeps its first |z|^2 past 4
+                    }
+                    // A lane stays active while |z|^2 <= 4
+                    active = _mm512_mask_cmp_pd_mask(active, mag, four, _CMP_LE_OQ);
+                    if (active == 0) {
+                        break;
+                    }
+                    n = _mm512_mask_add_pd(n, active, n, one);
+                    __m512d zrzi = _mm512_mul_pd(zr, zi);
+                    zi = _mm512_add_pd(_mm512_add_pd(zrzi, zrzi), ci);
+                    zr = _mm512_add_pd(_mm512_sub_pd(zr2, zi2), cr);
+                }
+                if (active == 0) {
+                    break; // All lanes escaped
+                }
+            } else {
+                n = _mm512_mask_add_pd(n, active, n, unrolled);
+            }
+            it += Unroll;
+            if (Periodicity) {
+                // Cycle detection at block granularity; the saved point is taken every 1, 2, 4, ... blocks
+                __mmask8 cycling = _mm512_mask_cmp_pd_mask(active, _mm512_abs_pd(_mm512_sub_pd(zr, savedR)), tolerance, _CMP_LT_OQ);
+                cycling = _mm512_mask_cmp_pd_mask(cycling, _mm512_abs_pd(_mm512_sub_pd(zi, savedI)), tolerance, _CMP_LT_OQ);
+                n = _mm512_mask_mov_pd(n, cycling, maxCount);
+                active = active & ~cycling;
+                if (++steps == interval) {
+                    savedR = zr;
+                    savedI = zi;
+                    steps = 0;
+                    interval *= 2;
+                }
+                if (active == 0) {
+                    break; // Every lane is cycling
+                }
+            }
+        }
+
+        // Single steps through the remaining iterations (all of them with Unroll == 1)
+        for (; it < max_iter; ++it) {
+            __m512d zr2 = _mm512_mul_pd(zr, zr);
+            __m512d zi2 = _mm512_mul_pd(zi, zi);
+            __m512d mag = _mm512_add_pd(zr2, zi2);
+            if (smooth) {
+                norm = _mm512_mask_mov_pd(norm, active, mag); // An escaping lane keeps its first |z|^2 past 4
+            }
+            // A lane stays active while |z|^2 <= 4
+            active = _mm512_mask_cmp_pd_mask(active, mag, four, _CMP_LE_OQ);
+            if (active == 0) {
+                break; // All lanes escaped
+            }
+            n = _mm512_mask_add_pd(n, active, n, one);
+            __m512d zrzi = _mm512_mul_pd(zr, zi);
+            zi = _mm512_add_pd(_mm512_add_pd(zrzi, zrzi), ci);
+            zr = _mm512_add_pd(_mm512_sub_pd(zr2, zi2), cr);
+
+            if (Periodicity && Unroll == 1) {
+                // |z - saved| below the tolerance in both components means the orbit is cycling
+                __mmask8 cycling = _mm512_mask_cmp_pd_mask(active, _mm512_abs_pd(_mm512_sub_pd(zr, savedR)), tolerance, _CMP_LT_OQ);
+                cycling = _mm512_mask_cmp_pd_mask(cycling, _mm512_abs_pd(_mm512_sub_pd(zi, savedI)), tolerance, _CMP_LT_OQ);
+                n = _mm512_mask_mov_pd(n, cycling, maxCount);
+                active = active & ~cycling;
+                if (++steps == interval) {
+                    savedR = zr;
+                    savedI = zi;
+                    steps = 0;
+                    interval *= 2;
+                }
+            }
+        }
+
+        double n_out[8];
+        _mm512_storeu_pd(n_out, n);
+        for (int l = 0; l < lanes; ++l) {
+            iters[i + l] = static_cast<int>(n_out[l]);
+        }
+        if (smooth) {
+            double norm_out[8];
+            _mm512_storeu_pd(norm_out, norm);
+            for (int l = 0; l < lanes; ++l) {
+                norms[i + l] = static_cast<float>(norm_out[l]);
+            }
+        }
+    }
+}
+
+// Single-precision AVX2 row-batch kernel: the double AVX2 kernel with 8 float lanes, for views where float
+// resolves every pixel (see choosePrecision). The sample coordinates are rounded to float on the way in.
+template <bool Periodicity, int Unroll>
+__attribute__((target("avx2")))
+void computeMandelbrotBatchAVX2Float(const double *real, const double *imag, int count, int max_iter, int *iters, float *norms) {
+    const __m256 four = _mm256_set1_ps(4.0f);
+    const __m256 one = _mm256_set1_ps(1.0f);
+    const __m256 unrolled = _mm256_set1_ps(Unroll);
+    const __m256 maxCount = _mm256_set1_ps(max_iter);
+    const __m256 tolerance = _mm256_set1_ps(PERIOD_TOLERANCE_FLOAT);
+    const __m256 signMask = _mm256_set1_ps(-0.0f);
+    const bool smooth = norms != NULL;
+    for (int i = 0; i < count; i += 8) {
+        // Pad a partial last group with a point that escapes on the second iteration
+        float cr_in[8] = {4.0f, 4.0f, 4.0f, 4.0f, 4.0f, 4.0f, 4.0f, 4.0f}, ci_in[8] = {0.0f};
+        int lanes = std::min(8, count - i);
+        for (int l = 0; l < lanes; ++l) {
+            cr_in[l] = static_cast<float>(real[i + l]);
+            ci_in[l] = static_cast<float>(imag[i + l]);
+        }
+        __m256 cr = _mm256_loadu_ps(cr_in);
+        __m256 ci = _mm256_loadu_ps(ci_in);
+        __m256 zr = _mm256_setzero_ps();
+        __m256 zi = _mm256_setzero_ps();
+        __m256 savedR = _mm256_setzero_ps();
+        __m256 savedI = _mm256_setzero_ps();
+        int steps = 0, interval = 1; // The lanes run in lockstep, so they share the cycle-detection schedule
+        __m256 n = _mm256_setzero_ps(); // Per-lane iteration counters (exact up to 2^24)
+        __m256 norm = _mm256_setzero_ps(); // Per-lane |z|^2 at escape, kept with smooth coloring
+        __m256 active = _mm256_castsi256_ps(_mm256_set1_epi32(-1)); // Lanes that have not escaped yet
+
+        int it = 0;
+        // With Unroll > 1, blocks of Unroll iterations run with one escape test at the end. |z| only grows
+        // once it exceeds 2, so a lane that is inside after the block was inside throughout it.
+        while (Unroll > 1 && it + Unroll <= max_iter) {
+            __m256 zr0 = zr, zi0 = zi;
+            for (int u = 0; u < Unroll; ++u) {
+                __m256 zr2 = _mm256_mul_ps(zr, zr);
+                __m256 zi2 = _mm256_mul_ps(zi, zi);
+                __m256 zrzi = _mm256_mul_ps(zr, zi);
+                zi = _mm256_add_ps(_mm256_add_ps(zrzi, zrzi), ci);
+                zr = _mm256_add_ps(_mm256_sub_ps(zr2, zi2), cr);
+            }
+            __m256 inside = _mm256_cmp_ps(_mm256_add_ps(_mm256_mul_ps(zr, zr), _mm256_mul_ps(zi, zi)), four, _CMP_LE_OQ);
+            if (_mm256_movemask_ps(_mm256_andnot_ps(inside, active)) != 0) {
+                // An active lane escaped in the block: redo it one step at a time to find the exact counts
+                zr = zr0;
+                zi = zi0;
+                for (int u = 0; u < Unroll; ++u) {
+                    __m256 zr2 = _mm256_mul_ps(zr, zr);
+                    __m256 zi2 = _mm256_mul_ps(zi, zi);
+                    __m256 mag = _mm256_add_ps(zr2, zi2);
+                    if (smooth) {
+                        norm = _mm256_blendv_ps(norm, mag, active); // An escaping lane keeps its first |z|^2 past 4
+                    }
+                    // A lane stays active while |z|^2 <= 4
+                    active = _mm256_and_ps(active, _mm256_cmp_ps(mag, four, _CMP_LE_OQ));
+                    if (_mm256_movemask_ps(active) == 0) {
+                        break;
+                    }
+                    n = _mm256_add_ps(n, _mm256_and_ps(active, one));
+                    __m256 zrzi = _mm256_mul_ps(zr, zi);
+                    zi = _mm256_add_ps(_mm256_add_ps(zrzi, zrzi), ci);
+                    zr = _mm256_add_ps(_mm256_sub_ps(zr2, zi2), cr);
+                }
+                if (_mm256_movemask_ps(active) == 0) {
+                    break; // All lanes escaped
+                }
+            } else {
+                n = _mm256_add_ps(n, _mm256_and_ps(active, unrolled));
+            }
+            it += Unroll;
+            if (Periodicity) {
+                // Cycle detection at block granularity; the saved point is taken every 1, 2, 4, ... blocks
+                __m256 dr = _mm256_andnot_ps(signMask, _mm256_sub_ps(zr, savedR));
+                __m256 di = _mm256_andnot_ps(signMask, _mm256_sub_ps(zi, savedI));
+                __m256 cycling = _mm256_and_ps(active, _mm256_and_ps(_mm256_cmp_ps(dr, tolerance, _CMP_LT_OQ), _mm256_cmp_ps(di, tolerance, _CMP_LT_OQ)));
+                n = _mm256_blendv_ps(n, maxCount, cycling);
+                active = _mm256_andnot_ps(cycling, active);
+                if (++steps == interval) {
+                    savedR = zr;
+                    savedI = zi;
+                    steps = 0;
+                    interval *= 2;
+                }
+                if (_mm256_movemask_ps(active) == 0) {
+                    break; // Every lane is cycling
+                }
+            }
+        }
+
+        // Single steps through the remaining iterations (all of them with Unroll == 1)
+        for (; it < max_iter; ++it) {
+            __m256 zr2 = _mm256_mul_ps(zr, zr);
+            __m256 zi2 = _mm256_mul_ps(zi, zi);
+            __m256 mag = _mm256_add_ps(zr2, zi2);
+            if (smooth) {
+                norm = _mm256_blendv_ps(norm, mag, active); // An escaping lane keeps its first |z|^2 past 4
+            }
+            // A lane stays active while |z|^2 <= 4
+            active = _mm256_and_ps(active, _mm256_cmp_ps(mag, four, _CMP_LE_OQ));
+            if (_mm256_movemask_ps(active) == 0) {
+                break; // All lanes escaped
+            }
+            n = _mm256_add_ps(n, _mm256_and_ps(active, one));
+            __m256 zrzi = _mm256_mul_ps(zr, zi);
+            zi = _mm256_add_ps(_mm256_add_ps(zrzi, zrzi), ci);
+            zr = _mm256_add_ps(_mm256_sub_ps(zr2, zi2), cr);
+
+            if (Periodicity && Unroll == 1) {
+                // |z - saved| below the tolerance in both components means the orbit is cycling
+                __m256 dr = _mm256_andnot_ps(signMask, _mm256_sub_ps(zr, savedR));
+                __m256 di = _mm256_andnot_ps(signMask, _mm256_sub_ps(zi, savedI));
+                __m256 cycling = _mm256_and_ps(active, _mm256_and_ps(_mm256_cmp_ps(dr, tolerance, _CMP_LT_OQ), _mm256_cmp_ps(di, tolerance, _CMP_LT_OQ)));
+                n = _mm256_blendv_ps(n, maxCount, cycling);
+                active = _mm256_andnot_ps(cycling, active);
+                if (++steps == interval) {
+                    savedR = zr;
+                    savedI = zi;
+                    steps = 0;
+                    interval *= 2;
+                }
+            }
+        }
+
+        float n_out[8];
+        _mm256_storeu_ps(n_out, n);
+        for (int l = 0; l < lanes; ++l) {
+            iters[i + l] = static_cast<int>(n_out[l]);
+        }
+        if (smooth) {
+            float norm_out[8];
+            _mm256_storeu_ps(norm_out, norm);
+            for (int l = 0; l < lanes; ++l) {
+                norms[i + l] = static_cast<float>(norm_out[l]);
+            }
+        }
+    }
+}
+
+// Single-precision AVX-512 row-batch kernel: the double AVX-512 kernel with 16 float lanes.
+template <bool Periodicity, int Unroll>
+__attribute__((target("avx512f"), optimize("fp-contract=off")))
+void computeMandelbrotBatchAVX512Float(const double *real, const double *imag, int count, int max_iter, int *iters, float *norms) {
+    const __m512 four = _mm512_set1_ps(4.0f);
+    const __m512 one = _mm512_set1_ps(1.0f);
+    const __m512 unrolled = _mm512_set1_ps(Unroll);
+    const __m512 maxCount = _mm512_set1_ps(max_iter);
+    const __m512 tolerance = _mm512_set1_ps(PERIOD_TOLERANCE_FLOAT);
+    const bool smooth = norms != NULL;
+    for (int i = 0; i < count; i += 16) {
+        // Lanes past the end of the batch start inactive
+        int lanes = std::min(16, count - i);
+        __mmask16 active = static_cast<__mmask16>((1u << lanes) - 1);
+        float cr_in[16] = {0.0f}, ci_in[16] = {0.0f};
+        for (int l = 0; l < lanes; ++l) {
+            cr_in[l] = static_cast<float>(real[i + l]);
+            ci_in[l] = static_cast<float>(imag[i + l]);
+        }
+        __m512 cr = _mm512_loadu_ps(cr_in);
+        __m512 ci = _mm512_loadu_ps(ci_in);
+        __m512 zr = _mm512_setzero_ps();
+        __m512 zi = _mm512_setzero_ps();
+        __m512 savedR = _mm512_setzero_ps();
+        __m512 savedI = _mm512_setzero_ps();
+        int steps = 0, interval = 1; // The lanes run in lockstep, so they share the cycle-detection schedule
+        __m512 n = _mm512_setzero_ps(); // Per-lane iteration counters (exact up to 2^24)
+        __m512 norm = _mm512_setzero_ps(); // Per-lane |z|^2 at escape, kept with smooth coloring
+
+        int it = 0;
+        // With Unroll > 1, blocks of Unroll iterations run with one escape test at the end. |z| only grows
+        // once it exceeds 2, so a lane that is inside after the block was inside throughout it.
+        while (Unroll > 1 && it + Unroll <= max_iter) {
+            __m512 zr0 = zr, zi0 = zi;
+            for (int u = 0; u < Unroll; ++u) {
+                __m512 zr2 = _mm512_mul_ps(zr, zr);
+                __m512 zi2 = _mm512_mul_ps(zi, zi);
+                __m512 zrzi = _mm512_mul_ps(zr, zi);
+                zi = _mm512_add_ps(_mm512_add_ps(zrzi, zrzi), ci);
+                zr = _mm512_add_ps(_mm512_sub_ps(zr2, zi2), cr);
+            }
+            __mmask16 inside = _mm512_mask_cmp_ps_mask(active, _mm512_add_ps(_mm512_mul_ps(zr, zr), _mm512_mul_ps(zi, zi)), four, _CMP_LE_OQ);
+            if (inside != active) {
+                // An active lane escaped in the block: redo it one step at a time to find the exact counts
+                zr = zr0;
+                zi = zi0;
+                for (int u = 0; u < Unroll; ++u) {
+                    __m512 zr2 = _mm512_mul_ps(zr, zr);
+                    __m512 zi2 = _mm512_mul_ps(zi, zi);
+                    __m512 mag = _mm512_add_ps(zr2, zi2);
+                    if (smooth) {
+                        norm = _mm512_mask_mov_ps(norm, active, mag); // An escaping lane keeps its first |z|^2 past 4
+                    }
+                    // A lane stays active while |z|^2 <= 4
+                    active = _mm512_mask_cmp_ps_mask(active, mag, four, _CMP_LE_OQ);
+                    if (active == 0) {
+                        break;
+                    }
+                    n = _mm512_mask_add_ps(n, active, n, one);
+                    __m512 zrzi = _mm512_mul_ps(zr, zi);
+                    zi = _mm512_add_ps(_mm512_add_ps(zrzi, zrzi), ci);
+                    zr = _mm512_add_ps(_mm512_sub_ps(zr2, zi2), cr);
+                }
+                if (active == 0) {
+                    break; // All lanes escaped
+                }
+            } else {
+                n = _mm512_mask_add_ps(n, active, n, unrolled);
+            }
+            it += Unroll;
+            if (Periodicity) {
+                // Cycle detection at block granularity; the saved point is taken every 1, 2, 4, ... blocks
+                __mmask16 cycling = _mm512_mask_cmp_ps_mask(active, _mm512_abs_ps(_mm512_sub_ps(zr, savedR)), tolerance, _CMP_LT_OQ);
+                cycling = _mm512_mask_cmp_ps_mask(cycling, _mm512_abs_ps(_mm512_sub_ps(zi, savedI)), tolerance, _CMP_LT_OQ);
+                n = _mm512_mask_mov_ps(n, cycling, maxCount);
+                active = active & ~cycling;
+                if (++steps == interval) {
+                    savedR = zr;
+                    savedI = zi;
+                    steps = 0;
+                    interval *= 2;
+                }
+                if (active == 0) {
+                    break; // Every lane is cycling
+                }
+            }
+        }
+
+        // Single steps through the remaining iterations (all of them with Unroll == 1)
+        for (; it < max_iter; ++it) {
+            __m512 zr2 = _mm512_mul_ps(zr, zr);
+            __m512 zi2 = _mm512_mul_ps(zi, zi);
+            __m512 mag = _mm512_add_ps(zr2, zi2);
+            if (smooth) {
+                norm = _mm512_mask_mov_ps(norm, active, mag); // An escaping lane keeps its first |z|^2 past 4
+            }
+            // A lane stays active while |z|^2 <= 4
+            active = _mm512_mask_cmp_ps_mask(active, mag, four, _CMP_LE_OQ);
+            if (active == 0) {
+                break; // All lanes escaped
+            }
+            n = _mm512_mask_add_ps(n, active, n, one);
+            __m512 zrzi = _mm512_mul_ps(zr, zi);
+            zi = _mm512_add_ps(_mm512_add_ps(zrzi, zrzi), ci);
+            zr = _mm512_add_ps(_mm512_sub_ps(zr2, zi2), cr);
+
+            if (Periodicity && Unroll == 1) {
+                // |z - saved| below the tolerance in both components means the orbit is cycling
+                __mmask16 cycling = _mm512_mask_cmp_ps_mask(active, _mm512_abs_ps(_mm512_sub_ps(zr, savedR)), tolerance, _CMP_LT_OQ);
+                cycling = _mm512_mask_cmp_ps_mask(cycling, _mm512_abs_ps(_mm512_sub_ps(zi, savedI)), tolerance, _CMP_LT_OQ);
+                n = _mm512_mask_mov_ps(n, cycling, maxCount);
+                active = active & ~cycling;
+                if (++steps == interval) {
+                    savedR = zr;
+                    savedI = zi;
+                    steps = 0;
+                    interval *= 2;
+                }
+            }
+        }
+
+        float n_out[16];
+        _mm512_storeu_ps(n_out, n);
+        for (int l = 0; l < lanes; ++l) {
+            iters[i + l] = static_cast<int>(n_out[l]);
+        }
+        if (smooth) {
+            float norm_out[16];
+            _mm512_storeu_ps(norm_out, norm);
+            for (int l = 0; l < lanes; ++l) {
+                norms[i + l] = static_cast<float>(norm_out[l]);
+            }
+        }
+    }
+}
+#endif
+
+// This function tests whether c = x + iy lies in the main cardioid or the period-2 bulb of the Mandelbrot set.
+// Points in either region never escape, so their escape count is max_iter without iterating.
+bool inCardioidOrBulb(double x, double y) {
+    double y2 = y * y;
+    double xq = x - 0.25;
+    double q = xq * xq + y2;
+    if (q * (q + xq) <= 0.25 * y2) {
+        return true; // Main cardioid
+    }
+    double xb = x + 1.0;
+    return xb * xb + y2 <= 0.0625; // Period-2 bulb (radius 1/4 around -1)
+}
+
+// This function computes the escape counts of a batch of samples with the given row-batch kernel. With
+// interiorCheck, samples in the main cardioid or period-2 bulb get max_iter at once and only the remaining
+// samples are packed into the scratch arrays and passed to the kernel, so no SIMD lane is spent on them.
+// With norms, the kernel also stores the escape |z|^2 of each sample there. It returns the number of samples
+// passed to the kernel.
+int computeBatch(BatchKernel kernel, bool interiorCheck, const double *real, const double *imag, int count, int max_iter, int *iters, float *norms, BatchScratch &scratch) {
+    if (!interiorCheck) {
+        kernel(real, imag, count, max_iter, iters, norms);
+        return count;
+    }
+    scratch.real.resize(count);
+    scratch.imag.resize(count);
+    scratch.index.resize(count);
+    scratch.iters.resize(count);
+    if (norms != NULL) {
+        scratch.norms.resize(count);
+    }
+    int remaining = 0;
+    for (int i = 0; i < count; ++i) {
+        if (inCardioidOrBulb(real[i], imag[i])) {
+            iters[i] = max_iter;
+        } else {
+            scratch.real[remaining] = real[i];
+            scratch.imag[remaining] = imag[i];
+            scratch.index[remaining] = i;
+            ++remaining;
+        }
+    }
+    if (remaining > 0) {
+        kernel(scratch.real.data(), scratch.imag.data(), remaining, max_iter, scratch.iters.data(), norms != NULL ? scratch.norms.data() : NULL);
+        for (int k = 0; k < remaining; ++k) {
+            iters[scratch.index[k]] = scratch.iters[k];
+        }
+        if (norms != NULL) {
+            for (int k = 0; k < remaining; ++k) {
+                norms[scratch.index[k]] = scratch.norms[k];
+            }
+        }
+    }
+    return remaining;
+}
+
+// Kernel families for instantiateKernel: get<Periodicity, Unroll>() returns that instantiation of the family's kernel
+template <typename T>
+struct ScalarKernels {
+    template <bool Periodicity, int Unroll> static BatchKernel get() { return computeMandelbrotBatchScalar<T, Periodicity, Unroll>; }
+};
+#ifdef MANDEL_X86_SIMD
+struct AVX2Kernels {
+    template <bool Periodicity, int Unroll> static BatchKernel get() { return computeMandelbrotBatchAVX2<Periodicity, Unroll>; }
+};
+struct AVX512Kernels {
+    template <bool Periodicity, int Unroll> static BatchKernel get() { return computeMandelbrotBatchAVX512<Periodicity, Unroll>; }
+};
+struct AVX2FloatKernels {
+    template <bool Periodicity, int Unroll> static BatchKernel get() { return computeMandelbrotBatchAVX2Float<Periodicity, Unroll>; }
+};
+struct AVX512FloatKernels {
+    template <bool Periodicity, int Unroll> static BatchKernel get() { return computeMandelbrotBatchAVX512Float<Periodicity, Unroll>; }
+};
+#endif
+
+// This function returns the instantiation of a kernel family for the cycle-detection and unroll settings.
+// Every family is compiled for unroll factors 1, 2, 4 and 8; other factors round down to one of them.
+template <typename Family>
+BatchKernel instantiateKernel(bool periodicity, int unroll) {
+    if (unroll >= 8) {
+        return periodicity ? Family::template get<true, 8>() : Family::template get<false, 8>();
+    }
+    if (unroll >= 4) {
+        return periodicity ? Family::template get<true, 4>() : Family::template get<false, 4>();
+    }
+    if (unroll >= 2) {
+        return periodicity ? Family::template get<true, 2>() : Family::template get<false, 2>();
+    }
+    return periodicity ? Family::template get<true, 1>() : Family::template get<false, 1>();
+}
+
+// This function picks the row-batch kernel. KERNEL_AUTO chooses the widest SIMD kernel the CPU supports
+// (checked with CPUID at run time); an explicit choice the CPU cannot run falls back to the scalar kernel.
+// Each kernel is compiled with and without cycle detection, in double and single precision and for each
+// unroll factor, so the choice costs nothing in the loop.
+BatchKernel selectKernel(int kernelType, bool periodicity, bool singlePrecision, int unroll, int &selected) {
+#ifdef MANDEL_X86_SIMD
+    __builtin_cpu_init();
+    bool hasAVX512 = __builtin_cpu_supports("avx512f");
+    bool hasAVX2 = __builtin_cpu_supports("avx2");
+    if (kernelType == KERNEL_AUTO) {
+        kernelType = hasAVX512 ? KERNEL_AVX512 : (hasAVX2 ? KERNEL_AVX2 : KERNEL_SCALAR);
+    }
+    if (kernelType == KERNEL_AVX512 && hasAVX512) {
+        selected = KERNEL_AVX512;
+        if (singlePrecision) {
+            return instantiateKernel<AVX512FloatKernels>(periodicity, unroll);
+        }
+        return instantiateKernel<AVX512Kernels>(periodicity, unroll);
+    }
+    if (kernelType == KERNEL_AVX2 && hasAVX2) {
+        selected = KERNEL_AVX2;
+        if (singlePrecision) {
+            return instantiateKernel<AVX2FloatKernels>(periodicity, unroll);
+        }
+        return instantiateKernel<AVX2Kernels>(periodicity, unroll);
+    }
+#endif
+    selected = KERNEL_SCALAR;
+    if (singlePrecision) {
+        return instantiateKernel<ScalarKernels<float> >(periodicity, unroll);
+    }
+    return instantiateKernel<ScalarKernels<double> >(periodicity, unroll);
+}
+
+// This function chooses the precision of the tile x0 <= x < x1, y0 <= y < y1: double, unless the pixel spacing is
+// below max_iter units of double roundoff of the largest value in the tile's orbits (|z| up to 2, or a larger
+// |c|), because rounding errors grow along the orbit; then double-double. Float is never chosen here: orbits
+// near the set boundary amplify roundoff far beyond that bound (float changes thousands of pixels of the
+// zoom 1 view at -i 300), so it is only used when requested. An explicit -precision is used as given.
+int choosePrecision(int requested, int x0, int y0, int x1, int y1, double scale, double move_x, double move_y, int max_iter) {
+    if (requested != PRECISION_AUTO) {
+        return requested;
+    }
+    double extent = 2.0;
+    extent = std::max(extent, std::max(std::fabs(x0 * scale + move_x), std::fabs(x1 * scale + move_x)));
+    extent = std::max(extent, std::max(std::fabs(y0 * scale + move_y), std::fabs(y1 * scale + move_y)));
+    double margin = std::max(1, max_iter) * extent;
+    if (scale >= margin * DBL_EPSILON) {
+        return PRECISION_DOUBLE;
+    }
+    return PRECISION_DD;
+}
+
+// This function resolves -deep for the view at (center_x, center_y) and zoom: perturbation past DEEP_ZOOM, and
+// also below it when -precision auto would send any tile of the frame to double-double, whose scalar loop is
+// far slower than perturbation (the whole frame's extent bounds every tile's). Explicit -precision dd keeps it.
+bool usePerturbation(const RenderConfig &config, double center_x, double center_y, double zoom) {
+    if (config.deepMode != DEEP_AUTO) {
+        return config.deepMode == DEEP_ON;
+    }
+    if (zoom > DEEP_ZOOM) {
+        return true;
+    }
+    double scale = 4.0 / (config.width * zoom);
+    double move_x = center_x - config.width / 2.0 * scale;
+    double move_y = center_y - config.height / 2.0 * scale;
+    return config.precisionType == PRECISION_AUTO && choosePrecision(PRECISION_AUTO, 0, 0, config.width, config.height, scale, move_x, move_y, config.max_iter) == PRECISION_DD;
+}
+
+// This function sets up the sample grid of a tile: it chooses the tile's precision and the matching kernel.
+// Double-double samples are offsets from the view center (see computeSamples), like those of deep-zoom mode.
+SampleGrid makeSampleGrid(int x0, int y0, int w, int h, const RenderConfig &config, const RenderState &state, int *iters, float *norms) {
+    SampleGrid grid = {x0, y0, w, h, 0.0, 0.0, state.scale, state.move_x, state.move_y, config.max_iter, state.kernel, config.interiorCheck, PRECISION_DOUBLE, &state.precision, state.orbit, iters, norms, state.stats};
+    if (state.orbit == NULL) {
+        grid.precision = choosePrecision(state.precision.precision, x0, y0, x0 + w, y0 + h, state.scale, state.move_x, state.move_y, config.max_iter);
+    }
+    if (grid.precision == PRECISION_FLOAT) {
+        grid.kernel = state.precision.floatKernel;
+    } else if (grid.precision == PRECISION_DD) {
+        grid.move_x = -config.width / 2.0 * state.scale;
+        grid.move_y = -config.height / 2.0 * state.scale;
+    }
+    return grid;
+}
+
+// This function negates a fixed-point number in place (two's complement).
+void fixedNegate(FixedPoint &a) {
+    uint64_t carry = 1;
+    for (size_t k = 0; k < a.limb.size(); ++k) {
+        uint64_t v = static_cast<uint64_t>(static_cast<uint32_t>(~a.limb[k])) + carry;
+        a.limb[k] = static_cast<uint32_t>(v);
+        carry = v >> 32;
+    }
+}
+
+// This function returns a + b. Both operands must have the same number of limbs.
+FixedPoint fixedAdd(const FixedPoint &a, const FixedPoint &b) {
+    FixedPoint sum;
+    sum.limb.resize(a.limb.size());
+    uint64_t carry = 0;
+    for (size_t k = 0; k < a.limb.size(); ++k) {
+        uint64_t v = static_cast<uint64_t>(a.limb[k]) + b.limb[k] + carry;
+        sum.limb[k] = static_cast<uint32_t>(v);
+        carry = v >> 32;
+    }
+    return sum;
+}
+
+// This function returns a - b.
+FixedPoint fixedSub(const FixedPoint &a, const FixedPoint &b) {
+    FixedPoint negB = b;
+    fixedNegate(negB);
+    return fixedAdd(a, negB);
+}
+
+// This function returns a * b, truncated to the precision of the operands. The magnitudes are multiplied
+// limb by limb (schoolbook) and the sign is applied afterwards.
+FixedPoint fixedMul(const FixedPoint &a, const FixedPoint &b) {
+    int L = a.limb.size();
+    FixedPoint x = a, y = b;
+    bool negX = x.limb.back() & 0x80000000u;
+    bool negY = y.limb.back() & 0x80000000u;
+    if (negX) fixedNegate(x);
+    if (negY) fixedNegate(y);
+    std::vector<uint32_t> product(2 * L, 0);
+    for (int i = 0; i < L; ++i) {
+        uint64_t carry = 0;
+        for (int j = 0; j < L; ++j) {
+            uint64_t v = static_cast<uint64_t>(x.limb[i]) * y.limb[j] + product[i + j] + carry;
+            product[i + j] = static_cast<uint32_t>(v);
+            carry = v >> 32;
+        }
+        product[i + L] = static_cast<uint32_t>(carry);
+    }
+    // Both factors have L - 1 fractional limbs, so the product has 2L - 2 of them; keep the top L - 1
+    FixedPoint result;
+    result.limb.assign(product.begin() + (L - 1), product.begin() + (2 * L - 1));
+    if (negX != negY) fixedNegate(result);
+    return result;
+}
+
+// This function rounds a fixed-point number to the nearest double.
+double fixedToDouble(const FixedPoint &a) {
+    FixedPoint x = a;
+    bool negative = x.limb.back() & 0x80000000u;
+    if (negative) fixedNegate(x);
+    int L = x.limb.size();
+    double value = 0.0;
+    for (int k = 0; k < L; ++k) {
+        value += std::ldexp(static_cast<double>(x.limb[k]), 32 * (k - (L - 1)));
+    }
+    return negative ? -value : value;
+}
+
+// This function parses a decimal number such as "-1.7548776662466927600495" or "3.2e-5" into a fixed-point
+// number with the given number of limbs, without going through double, so every digit given is kept.
+FixedPoint fixedFromString(const std::string &text, int limbs) {
+    std::string s = text;
+    bool negative = false;
+    if (!s.empty() && (s[0] == '-' || s[0] == '+')) {
+        negative = s[0] == '-';
+        s = s.substr(1);
+    }
+    int exponent = 0;
+    size_t e = s.find_first_of("eE");
+    if (e != std::string::npos) {
+        exponent = std::atoi(s.c_str() + e + 1);
+        s = s.substr(0, e);
+    }
+    // Move the decimal point by the exponent, then split into integer and fraction digits
+    size_t point = s.find('.');
+    std::string digits = (point == std::string::npos) ? s : s.substr(0, point) + s.substr(point + 1);
+    int position = static_cast<int>(point == std::string::npos ? s.size() : point) + exponent;
+    if (position < 0) {
+        digits = std::string(-position, '0') + digits;
+        position = 0;
+    }
+    if (position > static_cast<int>(digits.size())) {
+        digits += std::string(position - digits.size(), '0');
+    }
+
+    FixedPoint value;
+    value.limb.assign(limbs, 0);
+    // Fraction: Horner's scheme from the last digit, dividing by 10 after adding each digit
+    for (int d = digits.size() - 1; d >= position; --d) {
+        value.limb.back() += digits[d] - '0';
+        uint64_t remainder = 0;
+        for (int k = limbs - 1; k >= 0; --k) {
+            uint64_t current = (remainder << 32) | value.limb[k];
+            value.limb[k] = static_cast<uint32_t>(current / 10);
+            remainder = current % 10;
+        }
+    }
+    // Integer part
+    uint32_t integer = 0;
+    for (int d = 0; d < position; ++d) {
+        integer = integer * 10 + (digits[d] - '0');
+    }
+    value.limb.back() = integer;
+    if (negative) fixedNegate(value);
+    return value;
+}
+
+// This function formats a fixed-point number in decimal with the given number of fraction digits, dropping
+// trailing zeros. The fraction is multiplied by 10 repeatedly; each time the digit carried into the integer
+// limb is the next one.
+std::string fixedToString(const FixedPoint &a, int digits) {
+    FixedPoint x = a;
+    bool negative = x.limb.back() & 0x80000000u;
+    if (negative) fixedNegate(x);
+    std::string text = (negative ? "-" : "") + std::to_string(x.limb.back()) + ".";
+    for (int d = 0; d < digits; ++d) {
+        x.limb.back() = 0;
+        uint64_t carry = 0;
+        for (size_t k = 0; k < x.limb.size(); ++k) {
+            uint64_t v = static_cast<uint64_t>(x.limb[k]) * 10 + carry;
+            x.limb[k] = static_cast<uint32_t>(v);
+            carry = v >> 32;
+        }
+        text += static_cast<char>('0' + x.limb.back());
+    }
+    text.erase(text.find_last_not_of('0') + 1);
+    if (text[text.size() - 1] == '.') text += '0';
+    return text;
+}
+
+// This function computes the orbit Z(n+1) = Z(n)^2 + C of the view center C in fixed point, with enough
+// fractional bits to resolve one pixel of an image width pixels wide at this zoom plus 64 guard bits, and
+// stores it rounded to doubles. The orbit stops after it escapes or after max_iter iterations.
+void computeReferenceOrbit(const std::string &center_x, const std::string &center_y, double zoom, int width, int max_iter, ReferenceOrbit &orbit) {
+    int fractionBits = static_cast<int>(std::ceil(std::log2(std::max(1.0, zoom * width)))) + 64;
+    int limbs = 1 + (fractionBits + 31) / 32;
+    FixedPoint cr = fixedFromString(center_x, limbs);
+    FixedPoint ci = fixedFromString(center_y, limbs);
+    FixedPoint zr, zi;
+    zr.limb.assign(limbs, 0);
+    zi.limb.assign(limbs, 0);
+
+    orbit.zr.clear();
+    orbit.zi.clear();
+    for (int n = 0; n <= max_iter; ++n) {
+        double r = fixedToDouble(zr);
+        double i = fixedToDouble(zi);
+        orbit.zr.push_back(r);
+        orbit.zi.push_back(i);
+        if (r * r + i * i > 4.0) {
+            break; // The center escaped; pixels that outlive it are rebased onto the start of the orbit
+        }
+        FixedPoint zr2 = fixedMul(zr, zr);
+        FixedPoint zi2 = fixedMul(zi, zi);
+        FixedPoint zrzi = fixedMul(zr, zi);
+        zi = fixedAdd(fixedAdd(zrzi, zrzi), ci);
+        zr = fixedAdd(fixedSub(zr2, zi2), cr);
+    }
+}
+
+// This function computes the escape count of the sample C + dc, where C is the reference point, by iterating
+// only the offset d(n) = z(n) - Z(n) in double: d(n+1) = 2 Z(n) d(n) + d(n)^2 + dc. When |z| becomes smaller
+// than |d| the offset has lost its precision (a glitch), and when the reference orbit ends it cannot be
+// followed further; in both cases the sample is rebased, i.e. its current z becomes the offset from Z(0) = 0.
+// If norm is given, the |z|^2 the sample escaped with is stored there.
+int computeMandelbrotPerturbed(const ReferenceOrbit &orbit, double dcr, double dci, int max_iter, float *norm) {
+    const double *Zr = orbit.zr.data();
+    const double *Zi = orbit.zi.data();
+    int last = orbit.zr.size() - 1; // Last stored point of the reference orbit
+    double dr = 0.0, di = 0.0; // Offset of this sample's orbit from the reference orbit
+    int m = 0; // Position in the reference orbit
+    for (int n = 0; n < max_iter; ++n) {
+        double zr = Zr[m] + dr;
+        double zi = Zi[m] + di;
+        double mag = zr * zr + zi * zi;
+        if (mag > 4.0) {
+            if (norm != NULL) {
+                *norm = static_cast<float>(mag);
+            }
+            return n; // Escaped
+        }
+        if (mag < dr * dr + di * di || m == last) {
+            dr = zr;
+            di = zi;
+            m = 0;
+        }
+        double ndr = 2.0 * (Zr[m] * dr - Zi[m] * di) + (dr * dr - di * di) + dcr;
+        double ndi = 2.0 * (Zr[m] * di + Zi[m] * dr) + 2.0 * dr * di + dci;
+        dr = ndr;
+        di = ndi;
+        ++m;
+    }
+    return max_iter;
+}
+
+// This function computes the escape counts of a batch of samples with the settings of grid. In deep-zoom mode
+// (grid.orbit is set) real and imag are offsets from the view center and the samples are perturbed from the
+// reference orbit; double-double grids are also given as offsets; otherwise they are passed to computeBatch
+// with the grid's float or double kernel. With norms (smooth coloring) the escape |z|^2 of each sample goes
+// there as well. With -stats the time and the work of the batch are added to the counters of the calling thread.
+void computeSamples(const SampleGrid &grid, const double *real, const double *imag, int count, int *iters, float *norms, BatchScratch &scratch) {
+    ThreadStats *stats = threadStats(grid.stats);
+    StatsClock::time_point start = (stats != NULL) ? StatsClock::now() : StatsClock::time_point();
+    int evaluated = count; // Samples that went through an escape-time loop
+    if (grid.orbit != NULL) {
+        for (int i = 0; i < count; ++i) {
+            iters[i] = computeMandelbrotPerturbed(*grid.orbit, real[i], imag[i], grid.max_iter, norms != NULL ? &norms[i] : NULL);
+        }
+    } else if (grid.precision == PRECISION_DD) {
+        // The samples are offsets from the double-double center; the cardioid test is not applied at these depths
+        const PrecisionSettings &settings = *grid.settings;
+        for (int i = 0; i < count; ++i) {
+            DoubleDouble cr = settings.center_x + DoubleDouble(real[i]);
+            DoubleDouble ci = settings.center_y + DoubleDouble(imag[i]);
+            float *norm = (norms != NULL) ? &norms[i] : NULL;
+            iters[i] = settings.periodicity ? computeMandelbrotPeriodic(cr, ci, grid.max_iter, norm) : computeMandelbrot(cr, ci, grid.max_iter, norm);
+        }
+    } else {
+        evaluated = computeBatch(grid.kernel, grid.interiorCheck, real, imag, count, grid.max_iter, iters, norms, scratch);
+    }
+    if (stats == NULL) {
+        return;
+    }
+    stats->computeSeconds += secondsSince(start);
+    // Samples skipped by the interior check have max_iter too, so they are taken back out of the sums
+    uint64_t iterations = 0;
+    int interior = 0;
+    for (int i = 0; i < count; ++i) {
+        iterations += iters[i];
+        interior += (iters[i] >= grid.max_iter);
+    }
+    int skipped = count - evaluated;
+    stats->kernelSamples += evaluated;
+    stats->cardioidSkips += skipped;
+    stats->iterations += iterations - (uint64_t)skipped * grid.max_iter;
+    stats->interiorSamples += interior - skipped;
+}
+
+// This function returns the filename of frame index of a batch: "mandelbrot.pnm" becomes "mandelbrot_00042.pnm".
+std::string frameFilename(const std::string &filename, int index) {
+    std::string base = filename.substr(0, filename.size() - 4); // parseArguments ensures the .pnm extension
+    std::string number = std::to_string(index);
+    return base + "_" + std::string(number.size() < 5 ? 5 - number.size() : 0, '0') + number + ".pnm";
+}
+
+// This function reads a keyframe file: one "center_x center_y zoom" view per line, blank lines and lines
+// starting with # ignored. The centers are kept as text so deep-zoom keyframes keep all their digits.
+bool readKeyframes(const std::string &path, std::vector<Frame> &keyframes) {
+    std::ifstream file(path);
+    if (!file) {
+        std::cerr << "Cannot open keyframe file '" << path << "'\n";
+        return false;
+    }
+    std::string line;
+    for (int lineNumber = 1; std::getline(file, line); ++lineNumber) {
+        size_t first = line.find_first_not_of(" \t\r");
+        if (first == std::string::npos || line[first] == '#') {
+            continue;
+        }
+        std::istringstream fields(line);
+        Frame frame;
+        if (!(fields >> frame.center_x_text >> frame.center_y_text >> frame.zoom) || frame.zoom <= 0.0) {
+            std::cerr << "Skipping malformed keyframe on line " << lineNumber << " of '" << path << "'\n";
+            continue;
+        }
+        frame.center_x = atof(frame.center_x_text.c_str());
+        frame.center_y = atof(frame.center_y_text.c_str());
+        keyframes.push_back(frame);
+    }
+    return !keyframes.empty();
+}
+
+// This function returns the view a fraction t of the way from keyframe a to keyframe b. The zoom changes
+// geometrically, and the center moves so that b's center drifts across the screen at a constant rate:
+// c = b - (b - a) * u with u = (a.zoom / zoom - a.zoom / b.zoom) / (1 - a.zoom / b.zoom), which is 1 at a
+// and shrinks with the pixel size towards b. The centers are interpolated in fixed point with as many bits as
+// the deeper keyframe needs, so zoom paths into deep-zoom targets stay on target.
+Frame interpolateFrame(const Frame &a, const Frame &b, double t, int width) {
+    Frame frame;
+    frame.zoom = a.zoom * std::pow(b.zoom / a.zoom, t);
+    double ratio = a.zoom / b.zoom;
+    double u = (std::fabs(ratio - 1.0) < 1e-12) ? 1.0 - t : (a.zoom / frame.zoom - ratio) / (1.0 - ratio);
+    int fractionBits = static_cast<int>(std::ceil(std::log2(std::max(1.0, std::max(a.zoom, b.zoom) * width)))) + 64;
+    int limbs = 1 + (fractionBits + 31) / 32;
+    std::ostringstream weightText;
+    weightText << std::setprecision(17) << std::scientific << u;
+    FixedPoint weight = fixedFromString(weightText.str(), limbs);
+    const std::string *ends[2][2] = {{&a.center_x_text, &b.center_x_text}, {&a.center_y_text, &b.center_y_text}};
+    std::string *texts[2] = {&frame.center_x_text, &frame.center_y_text};
+    for (int c = 0; c < 2; ++c) {
+        if (*ends[c][0] == *ends[c][1] || u == 0.0) {
+            *texts[c] = *ends[c][1];
+        } else if (u == 1.0) {
+            *texts[c] = *ends[c][0];
+        } else {
+            FixedPoint from = fixedFromString(*ends[c][0], limbs);
+            FixedPoint to = fixedFromString(*ends[c][1], limbs);
+            *texts[c] = fixedToString(fixedSub(to, fixedMul(fixedSub(to, from), weight)), 10 * (limbs - 1));
+        }
+    }
+    frame.center_x = atof(frame.center_x_text.c_str());
+    frame.center_y = atof(frame.center_y_text.c_str());
+    return frame;
+}
+
+// This function lists the frames to render. Without batch options that is the command-line view of config,
+// written to its filename. Otherwise the keyframes come from the -batch file, or are the command-line view
+// and the -x1/-y1/-z1 end view; -frames N samples N frames evenly along them, else every keyframe is one frame.
+void buildFrames(const AnimationSettings &animation, const RenderConfig &config, std::vector<Frame> &frames) {
+    Frame start;
+    start.center_x_text = config.center_x_text;
+    start.center_y_text = config.center_y_text;
+    start.center_x = config.center_x;
+    start.center_y = config.center_y;
+    start.zoom = config.zoom;
+    start.filename = config.filename;
+    frames.clear();
+    if (!animation.batch) {
+        frames.push_back(start);
+        return;
+    }
+
+    std::vector<Frame> keyframes;
+    if (!animation.keyframeFile.empty()) {
+        if (!readKeyframes(animation.keyframeFile, keyframes)) {
+            std::cerr << "No keyframes read, rendering the command-line view\n";
+            keyframes.assign(1, start);
+        }
+    } else {
+        Frame end = start;
+        if (!animation.end_x_text.empty()) end.center_x_text = animation.end_x_text;
+        if (!animation.end_y_text.empty()) end.center_y_text = animation.end_y_text;
+        if (animation.end_zoom > 0.0) end.zoom = animation.end_zoom;
+        end.center_x = atof(end.center_x_text.c_str());
+        end.center_y = atof(end.center_y_text.c_str());
+        keyframes.push_back(start);
+        keyframes.push_back(end);
+    }
+
+    int segments = keyframes.size() - 1;
+    if (animation.frames <= 0 || segments == 0) {
+        frames = keyframes;
+    } else {
+        for (int k = 0; k < animation.frames; ++k) {
+            // Position along the keyframes, from 0 at the first to segments at the last
+            double s = (animation.frames == 1) ? 0.0 : static_cast<double>(k) * segments / (animation.frames - 1);
+            int segment = std::min(static_cast<int>(s), segments - 1);
+            frames.push_back(interpolateFrame(keyframes[segment], keyframes[segment + 1], s - segment, config.width));
+        }
+    }
+    for (size_t k = 0; k < frames.size(); ++k) {
+        frames[k].filename = frameFilename(config.filename, k);
+    }
+}
+
+// This function writes the interleaved 8-bit RGB frame to a PNM file in one go.
+void writeImage(const std::string &filename, int format, int width, int height, const uint8_t *rgb) {
+    // Open the output file
+    std::ofstream imageFile(filename, std::ios::binary);
+    writeImageHeader(imageFile, format, width, height);
+    writeImageRows(&imageFile, format, rgb, width, height, true);
+}
+
+// This function writes the PNM file header of a width x height image.
+void writeImageHeader(std::ofstream &imageFile, int format, int width, int height) {
+    imageFile << (format == FORMAT_P6 ? "P6\n" : "P3\n") << width << " " << height << "\n255\n";
+}
+
+// This function appends rows of interleaved 8-bit RGB pixels to a PNM file after its header, and closes the
+// file after the last rows. P6 writes the rows as they are in memory with a single call; P3 writes one ASCII
+// "r g b" line per pixel, as the training material expects. Images are written a strip of rows at a time,
+// so no more than a strip has to be in memory.
+void writeImageRows(std::ofstream *imageFile, int format, const uint8_t *rgb, int width, int rows, bool last) {
+    if (format == FORMAT_P6) {
+        imageFile->write(reinterpret_cast<const char *>(rgb), (std::streamsize)3 * width * rows);
+    } else {
+        for (size_t idx = 0; idx < (size_t)width * rows; ++idx) {
+            *imageFile << int(rgb[3 * idx]) << " " << int(rgb[3 * idx + 1]) << " " << int(rgb[3 * idx + 2]) << "\n";
+        }
+    }
+    if (last) {
+        // Close the file
+        imageFile->close();
+    }
+}
+
+// This function returns the number of rows rendered and written at a time: -strip if given, else as many
+// whole tile rows as fit twice (one strip is written while the next is computed) into STRIP_BUDGET, counting
+// the escape counts of the strip with -field.
+int chooseStripRows(const RenderConfig &config) {
+    int rows = config.stripRows;
+    if (rows == 0) {
+        size_t sampleBytes = sizeof(int) + (config.coloring == COLORING_SMOOTH ? sizeof(float) : 0); // Escape count and |z|^2 of a sample
+        size_t rowBytes = 3 * (size_t)config.width + (config.saveField ? sampleBytes * config.aaSamples * (size_t)config.width : 0);
+        size_t fit = STRIP_BUDGET / (2 * rowBytes);
+        rows = std::max(1, static_cast<int>(std::min(fit, (size_t)config.height) / config.tileSize)) * config.tileSize;
+    }
+    return std::min(rows, config.height);
+}
+
+// This function returns the escape-field filename of an image: "mandelbrot.pnm" becomes "mandelbrot.field".
+std::string fieldFilename(const std::string &filename) {
+    return filename.substr(0, filename.size() - 4) + ".field"; // parseArguments ensures the .pnm extension
+}
+
+// This function returns the bytes per escape count in an escape field: 2 when every count up to max_iter fits.
+int fieldCountBytes(int max_iter) {
+    return (max_iter <= 0xffff) ? 2 : 4;
+}
+
+// This function returns the bytes each sample takes in an escape field: its count and, with FIELD_SMOOTH, its |z|^2.
+int fieldSampleBytes(const FieldHeader &header) {
+    return header.countBytes + ((header.flags & FIELD_SMOOTH) ? (int)sizeof(float) : 0);
+}
+
+// This function returns the escape-field header of a render of config with the given view.
+FieldHeader makeFieldHeader(const RenderConfig &config, int aaSide, double center_x, double center_y, double zoom) {
+    FieldHeader header;
+    std::copy(FIELD_MAGIC, FIELD_MAGIC + 8, header.magic);
+    header.width = config.width;
+    header.height = config.height;
+    header.aaSide = aaSide;
+    header.max_iter = config.max_iter;
+    header.countBytes = fieldCountBytes(config.max_iter);
+    header.flags = (config.coloring == COLORING_SMOOTH) ? FIELD_SMOOTH : 0;
+    header.center_x = center_x;
+    header.center_y = center_y;
+    header.zoom = zoom;
+    return header;
+}
+
+// This function stores count escape counts in out with countBytes (2 or 4) bytes each, as escape-field files hold them.
+// With norms, each count is followed by the 4 bytes of its escape |z|^2 (see FIELD_SMOOTH).
+void packCounts(const int *counts, const float *norms, size_t count, int countBytes, uint8_t *out) {
+    if (norms != NULL) {
+        const size_t sampleBytes = countBytes + sizeof(float);
+        for (size_t k = 0; k < count; ++k) {
+            uint8_t *sample = out + k * sampleBytes;
+            uint16_t count16 = static_cast<uint16_t>(counts[k]);
+            uint32_t count32 = static_cast<uint32_t>(counts[k]);
+            const uint8_t *countBytesOf = (countBytes == 2) ? reinterpret_cast<const uint8_t *>(&count16) : reinterpret_cast<const uint8_t *>(&count32);
+            std::copy(countBytesOf, countBytesOf + countBytes, sample);
+            const uint8_t *normBytes = reinterpret_cast<const uint8_t *>(&norms[k]);
+            std::copy(normBytes, normBytes + sizeof(float), sample + countBytes);
+        }
+    } else if (countBytes == 2) {
+        uint16_t *packed = reinterpret_cast<uint16_t *>(out);
+        for (size_t k = 0; k < count; ++k) {
+            packed[k] = static_cast<uint16_t>(counts[k]);
+        }
+    } else {
+        std::copy(counts, counts + count, reinterpret_cast<uint32_t *>(out));
+    }
+}
+
+
+// This function returns the P6 header. Every process needs its length to compute its pixel offsets.
+std::string imageHeaderP6(int width, int height) {
+    return "P6\n" + std::to_string(width) + " " + std::to_string(height) + "\n255\n";
+}
+
+// This function writes rows firstRow, firstRow + rowStep, ... (numRows of them, stored consecutively in data)
+// into a file opened with MPI-IO whose rows are rowBytes long and start after start bytes of header.
+// Collective writes must be called by every process.
+void writeRowsAt(MPI_File fh, MPI_Offset start, int rowBytes, int firstRow, int numRows, int rowStep, const uint8_t *data, bool collective) {
+    const int bytes = numRows * rowBytes;
+    MPI_Offset offset = start + (MPI_Offset)firstRow * rowBytes;
+    if (rowStep == 1) {
+        // Contiguous rows go straight to their offset
+        if (collective) {
+            MPI_File_write_at_all(fh, offset, data, bytes, MPI_BYTE, MPI_STATUS_IGNORE);
+        } else {
+            MPI_File_write_at(fh, offset, data, bytes, MPI_BYTE, MPI_STATUS_IGNORE);
+        }
+    } else {
+        // Strided rows: set a file view that exposes only this process's rows, then write them in one call
+        MPI_Datatype rowsType;
+        MPI_Type_vector(numRows, rowBytes, rowStep * rowBytes, MPI_BYTE, &rowsType);
+        MPI_Type_commit(&rowsType);
+        MPI_File_set_view(fh, offset, MPI_BYTE, rowsType, "native", MPI_INFO_NULL);
+        MPI_File_write_at_all(fh, 0, data, bytes, MPI_BYTE, MPI_STATUS_IGNORE);
+        MPI_File_set_view(fh, 0, MPI_BYTE, MPI_BYTE, "native", MPI_INFO_NULL);
+        MPI_Type_free(&rowsType);
+    }
+}
+
+// This function writes rows firstRow, firstRow + rowStep, ... (numRows of them, stored consecutively in the
+// rgb frame buffer) into the width x height P6 file opened with MPI-IO, at their offsets after the header.
+void writeRowsMPIIO(MPI_File fh, int width, int height, int firstRow, int numRows, int rowStep, const uint8_t *rgb, bool collective) {
+    writeRowsAt(fh, imageHeaderP6(width, height).size(), 3 * width, firstRow, numRows, rowStep, rgb, collective);
+}
+
+// This function writes the escape counts of rows firstRow, firstRow + rowStep, ... (numRows rows of rowSamples
+// counts, stored consecutively in field) into the escape-field file opened with MPI-IO, packed to countBytes each
+// and, with norms, each followed by its escape |z|^2.
+void writeFieldRowsMPIIO(MPI_File fh, int countBytes, int rowSamples, int firstRow, int numRows, int rowStep, const int *field, const float *norms, bool collective) {
+    int sampleBytes = countBytes + (norms != NULL ? (int)sizeof(float) : 0);
+    std::vector<uint8_t> packed((size_t)sampleBytes * rowSamples * numRows);
+    packCounts(field, norms, (size_t)rowSamples * numRows, countBytes, packed.data());
+    writeRowsAt(fh, sizeof(FieldHeader), sampleBytes * rowSamples, firstRow, numRows, rowStep, packed.data(), collective);
+}
+
+// This function returns the statistics filename of an image: "mandelbrot.pnm" becomes "mandelbrot.stats.json",
+// or "mandelbrot.stats.csv" for the CSV format.
+std::string statsFilename(const std::string &filename, int format) {
+    return filename.substr(0, filename.size() - 4) + (format == STATS_CSV ? ".stats.csv" : ".stats.json"); // parseArguments ensures the .pnm extension
+}
+
+// This function returns the seconds from start to now on the clock of the -stats timers.
+double secondsSince(StatsClock::time_point start) {
+    return std::chrono::duration<double>(StatsClock::now() - start).count();
+}
+
+StatsTimer::StatsTimer(double *seconds) : seconds(seconds) {
+    if (seconds != NULL) {
+        start = StatsClock::now();
+    }
+}
+
+StatsTimer::~StatsTimer() {
+    if (seconds != NULL) {
+        *seconds += secondsSince(start);
+    }
+}
+
+// This function returns the time accumulator of a phase (see StatsPhase), or NULL when stats is NULL (-stats off).
+double *phaseSeconds(RunStats *stats, int phase) {
+    return (stats != NULL) ? &stats->seconds[phase] : NULL;
+}
+
+// This function returns the counters of the calling OpenMP thread, or NULL when stats is NULL (-stats off).
+ThreadStats *threadStats(RunStats *stats) {
+    if (stats == NULL) {
+        return NULL;
+    }
+#ifdef _OPENMP
+    return &stats->threads[omp_get_thread_num()];
+#else
+    return &stats->threads[0];
+#endif
+}
+
+// This function adds the counters of b to those of a.
+void addThreadStats(ThreadStats &a, const ThreadStats &b) {
+    a.computeSeconds += b.computeSeconds;
+    a.colorSeconds += b.colorSeconds;
+    a.kernelSamples += b.kernelSamples;
+    a.iterations += b.iterations;
+    a.interiorSamples += b.interiorSamples;
+    a.cardioidSkips += b.cardioidSkips;
+    a.fillSkips += b.fillSkips;
+    a.adaptiveSkips += b.adaptiveSkips;
+}
+
+// This function returns what precedes a value in the statistics file: ", "name": " in JSON, a comma in CSV.
+std::string statsKey(bool json, const std::string &name) {
+    return json ? ", \"" + name + "\": " : std::string(",");
+}
+
+// This function writes the counters of s, each preceded by statsKey.
+void writeThreadCounters(std::ostream &out, bool json, const ThreadStats &s) {
+    out << statsKey(json, "compute_seconds") << s.computeSeconds;
+    out << statsKey(json, "color_seconds") << s.colorSeconds;
+    out << statsKey(json, "kernel_samples") << s.kernelSamples;
+    out << statsKey(json, "iterations") << s.iterations;
+    out << statsKey(json, "interior_samples") << s.interiorSamples;
+    out << statsKey(json, "cardioid_skips") << s.cardioidSkips;
+    out << statsKey(json, "fill_skips") << s.fillSkips;
+    out << statsKey(json, "adaptive_skips") << s.adaptiveSkips;
+}
+
+// This function writes the statistics of a run to path; ranks[r] holds those of process r. JSON gives the run
+// totals and the rates derived from them at the top level, then every process with its phase times and its
+// threads. CSV gives one row per thread and, with thread "all", one per process with its phase times and the
+// sums of its threads' counters. A one-line summary goes to the standard output.
+void writeStats(const std::string &path, int format, const RenderConfig &config, int frames, const std::vector<RunStats> &ranks) {
+    std::ofstream out(path);
+    if (!out) {
+        std::cerr << "Cannot write statistics file '" << path << "'\n";
+        return;
+    }
+    out << std::setprecision(9);
+    const bool json = (format == STATS_JSON);
+
+    // Sum the threads of each process, and all processes
+    std::vector<ThreadStats> rankTotals(ranks.size(), ThreadStats());
+    ThreadStats total = ThreadStats();
+    double wallSeconds = 0.0; // The slowest process sets the wall time
+    for (size_t r = 0; r < ranks.size(); ++r) {
+        for (size_t t = 0; t < ranks[r].threads.size(); ++t) {
+            addThreadStats(rankTotals[r], ranks[r].threads[t]);
+        }
+        addThreadStats(total, rankTotals[r]);
+        wallSeconds = std::max(wallSeconds, ranks[r].seconds[PHASE_TOTAL]);
+    }
+    double megapixels = 1e-6 * config.width * config.height * frames;
+    double mpixPerSecond = (wallSeconds > 0.0) ? megapixels / wallSeconds : 0.0;
+    double iterationsPerSecond = (wallSeconds > 0.0) ? total.iterations / wallSeconds : 0.0;
+
+    if (!json) {
+        out << "rank,thread";
+        for (int p = 0; p < NUM_STATS_PHASES; ++p) {
+            out << "," << statsPhaseNames[p] << "_seconds";
+        }
+        out << ",compute_seconds,color_seconds,kernel_samples,iterations,interior_samples,cardioid_skips,fill_skips,adaptive_skips\n";
+        for (size_t r = 0; r < ranks.size(); ++r) {
+            out << r << ",all";
+            for (int p = 0; p < NUM_STATS_PHASES; ++p) {
+                out << "," << ranks[r].seconds[p];
+            }
+            writeThreadCounters(out, false, rankTotals[r]);
+            out << "\n";
+            for (size_t t = 0; t < ranks[r].threads.size(); ++t) {
+                out << r << "," << t << std::string(NUM_STATS_PHASES, ','); // Phases are timed per process only
+                writeThreadCounters(out, false, ranks[r].threads[t]);
+                out << "\n";
+            }
+        }
+    } else {
+        out << "{\"width\": " << config.width << ", \"height\": " << config.height << ", \"aa_samples\": " << config.aaSamples;
+        out << ", \"max_iter\": " << config.max_iter << ", \"frames\": " << frames << ", \"processes\": " << ranks.size() << ",\n";
+        out << " \"wall_seconds\": " << wallSeconds << ", \"mpix_per_second\": " << mpixPerSecond << ", \"iterations_per_second\": " << iterationsPerSecond;
+        out << ", \"iterations_per_thread_second\": " << (total.computeSeconds > 0.0 ? total.iterations / total.computeSeconds : 0.0) << ",\n";
+        out << " \"totals\": {\"samples\": " << total.kernelSamples + total.cardioidSkips + total.fillSkips;
+        writeThreadCounters(out, true, total);
+        out << "},\n \"ranks\": [";
+        for (size_t r = 0; r < ranks.size(); ++r) {
+            out << (r > 0 ? ",\n" : "\n") << "  {\"rank\": " << r;
+            for (int p = 0; p < NUM_STATS_PHASES; ++p) {
+                out << statsKey(true, std::string(statsPhaseNames[p]) + "_seconds") << ranks[r].seconds[p];
+            }
+            out << ", \"threads\": [";
+            for (size_t t = 0; t < ranks[r].threads.size(); ++t) {
+                out << (t > 0 ? ",\n" : "\n") << "   {\"thread\": " << t;
+                writeThreadCounters(out, true, ranks[r].threads[t]);
+                out << "}";
+            }
+            out << "]}";
+        }
+        out << "]}\n";
+    }
+    std::cout << std::left << std::setw(20) << "Statistics:" << mpixPerSecond << " Mpix/s, " << iterationsPerSecond << " iterations/s -> " << path << "\n";
+}
+
+// This function collects the statistics of every process on process 0, into ranks[r] for process r. Processes
+// may run different team sizes, so the thread counters travel as bytes (every process runs the same binary).
+void gatherStats(int rank, int size, const RunStats &local, std::vector<RunStats> &ranks) {
+    int threads = local.threads.size();
+    std::vector<int> threadCounts(size);
+    MPI_Gather(&threads, 1, MPI_INT, threadCounts.data(), 1, MPI_INT, 0, MPI_COMM_WORLD);
+    std::vector<double> seconds(rank == 0 ? NUM_STATS_PHASES * size : 0);
+    MPI_Gather(local.seconds, NUM_STATS_PHASES, MPI_DOUBLE, seconds.data(), NUM_STATS_PHASES, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+
+    std::vector<int> byteCounts(size), byteDispls(size);
+    int totalThreads = 0;
+    for (int r = 0; r < size; ++r) {
+        byteCounts[r] = threadCounts[r] * sizeof(ThreadStats);
+        byteDispls[r] = totalThreads * sizeof(ThreadStats);
+        totalThreads += threadCounts[r];
+    }
+    std::vector<ThreadStats> all(rank == 0 ? totalThreads : 0);
+    MPI_Gatherv(local.threads.data(), threads * sizeof(ThreadStats), MPI_BYTE, all.data(), byteCounts.data(), byteDispls.data(), MPI_BYTE, 0, MPI_COMM_WORLD);
+    if (rank != 0) {
+        return;
+    }
+    ranks.resize(size);
+    for (int r = 0, first = 0; r < size; first += threadCounts[r], ++r) {
+        std::copy(&seconds[r * NUM_STATS_PHASES], &seconds[(r + 1) * NUM_STATS_PHASES], ranks[r].seconds);
+        ranks[r].threads.assign(all.begin() + first, all.begin() + first + threadCounts[r]);
+    }
+}
+
+// This function maps an iteration count to a color by looking it up in the palette table built by buildPalette.
+void mapColor(int iter, const uint8_t *palette, int &r, int &g, int &b) {
+    r = palette[3 * iter];
+    g = palette[3 * iter + 1];
+    b = palette[3 * iter + 2];
+}
+
+// This function maps an escape count and the |z|^2 the orbit escaped with to a color by the normalized iteration
+// count nu = iter + 1 - log2(log2 |z|). With the escape radius 2, nu falls from iter + 1 for |z|^2 just past 4 to
+// iter for |z|^2 = 16, so it runs on continuously across the bands of equal escape count. The color is blended
+// from the palette entries of iter and iter + 1, so it costs two logarithms and no extra iterations.
+// Points inside the set stay black.
+void mapColorSmooth(int iter, float norm, int max_iter, const uint8_t *palette, int &r, int &g, int &b) {
+    if (iter >= max_iter) {
+        mapColor(max_iter, palette, r, g, b);
+        return;
+    }
+    float t = 1.0f - std::log2(0.5f * std::log2(norm)); // nu - iter
+    t = std::min(1.0f, std::max(0.0f, t)); // A first iterate far outside |z| = 4 would overshoot
+    const uint8_t *lo = &palette[3 * iter];
+    const uint8_t *hi = &palette[3 * std::min(iter + 1, max_iter - 1)]; // Never blend towards the black of the set
+    r = static_cast<int>(lo[0] + t * (hi[0] - lo[0]) + 0.5f);
+    g = static_cast<int>(lo[1] + t * (hi[1] - lo[1]) + 0.5f);
+    b = static_cast<int>(lo[2] + t * (hi[2] - lo[2]) + 0.5f);
+}
+
+// This function maps sample k of a batch to a color: by mapColorSmooth if norms (smooth coloring) is given, else
+// by mapColor.
+void mapSampleColor(const int *iters, const float *norms, int k, int max_iter, const uint8_t *palette, int &r, int &g, int &b) {
+    if (norms != NULL) {
+        mapColorSmooth(iters[k], norms[k], max_iter, palette, r, g, b);
+    } else {
+        mapColor(iters[k], palette, r, g, b);
+    }
+}
+
+// Original sinusoidal color scheme: three sine waves of frequency 0.1, phase-shifted per channel.
+void paletteSine(int iter, int &r, int &g, int &b) {
+    double frequency = 0.1;
+    r = static_cast<int>(sin(frequency * iter + 0) * 127 + 128);
+    g = static_cast<int>(sin(frequency * iter + 2) * 127 + 128);
+    b = static_cast<int>(sin(frequency * iter + 4) * 127 + 128);
+}
+
+// Fire color scheme: black through red and yellow to white, repeating every 96 iterations.
+void paletteFire(int iter, int &r, int &g, int &b) {
+    double t = 3.0 * (iter % 96) / 96.0;
+    r = static_cast<int>(255 * std::min(1.0, t));
+    g = static_cast<int>(255 * std::min(1.0, std::max(0.0, t - 1.0)));
+    b = static_cast<int>(255 * std::min(1.0, std::max(0.0, t - 2.0)));
+}
+
+// Ice color scheme: dark blue through cyan to white and back, repeating every 128 iterations.
+void paletteIce(int iter, int &r, int &g, int &b) {
+    double t = 0.5 - 0.5 * cos(2.0 * M_PI * (iter % 128) / 128.0);
+    r = static_cast<int>(255 * t * t);
+    g = static_cast<int>(255 * t);
+    b = static_cast<int>(96 + 159 * std::sqrt(t));
+}
+
+// Grayscale color scheme: a triangle wave from black to white and back every 128 iterations.
+void paletteGray(int iter, int &r, int &g, int &b) {
+    int v = (iter * 4) % 512;
+    r = g = b = (v > 255) ? 511 - v : v;
+}
+
+// This function builds the palette table: 3 bytes per iteration count 0..max_iter, so that coloring a
+// sample is one indexed load instead of three sin() calls. Points that reach max_iter are colored black.
+void buildPalette(int paletteType, int max_iter, std::vector<uint8_t> &palette) {
+    PaletteFunction schemes[] = {paletteSine, paletteFire, paletteIce, paletteGray};
+    PaletteFunction scheme = schemes[paletteType];
+    palette.assign(3 * (max_iter + 1), 0);
+    for (int iter = 0; iter < max_iter; ++iter) {
+        int r, g, b;
+        scheme(iter, r, g, b);
+        palette[3 * iter] = static_cast<uint8_t>(r);
+        palette[3 * iter + 1] = static_cast<uint8_t>(g);
+        palette[3 * iter + 2] = static_cast<uint8_t>(b);
     }
 }
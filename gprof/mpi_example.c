@@ -2,13 +2,19 @@
  * MPI Matrix Computation Example for gprof Demonstration
  *
  * This program demonstrates profiling MPI codes with gprof.
- * Each rank computes a portion of a distributed matrix operation.
+ * The ranks form a 2D process grid and each one holds a block of every
+ * matrix, so memory per rank shrinks as ranks are added; C = A * B is
+ * computed with SUMMA (Scalable Universal Matrix Multiplication).
  *
  * IMPORTANT: For accurate gprof profiling with MPI:
- * 1. Rename gmon.out after each run (per rank)
+ * 1. Each rank writes its own profile, gmon.out.rank<N>.<pid>
+ *    (set_profile_output); analyze one, or merge them with gprof -s
  * 2. Profile with a single rank for accurate results
  * 3. Or analyze a representative rank (e.g., rank 0)
  *
+ * At the end rank 0 prints a table of the time each phase took
+ * (MPI_Wtime), as min/avg/max over the ranks, to show load imbalance.
+ *
  * Usage: srun -n4 ./mpi_example [matrix_size]
  * Default matrix size: 500
  *
@@ -20,19 +26,207 @@
 #include <string.h>
 #include <math.h>
 #include <mpi.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define GEMM_X86_SIMD 1  /* Build the AVX2/AVX-512 kernels; used only if the CPU has them */
+#include <immintrin.h>
+#endif
+/*
+ * With -DUSE_CBLAS matrix_multiply calls the vendor BLAS dgemm instead
+ * (link with e.g. -lopenblas or -lmkl_rt), as a reference for the blocked kernel.
+ */
+#ifdef USE_CBLAS
+#include <cblas.h>
+#endif
+
+#define MATRIX_ALIGN 64  /* Alignment of matrix buffers and rows in bytes (one cache line) */
+
+/*
+ * Dense matrix in row-major order, held in one contiguous buffer
+ * aligned to MATRIX_ALIGN. Rows are padded to stride doubles, a
+ * multiple of the cache line, so every row starts on a cache-line
+ * boundary too. Element (i, j) is data[i * stride + j]. Because the
+ * buffer is contiguous, a whole matrix goes out in a single MPI call.
+ */
+typedef struct {
+    int rows;
+    int cols;
+    int stride;     /* Doubles from the start of one row to the next */
+    double* data;
+} Matrix;
+
+/* Phases timed with MPI_Wtime and reported by print_phase_table */
+enum Phase {
+    PHASE_INIT,      /* Allocation and initialization of the blocks */
+    PHASE_MULTIPLY,  /* Local GEMM of the SUMMA steps */
+    PHASE_BCAST,     /* SUMMA panel broadcasts */
+    PHASE_ADD_NORM,  /* Fused D = C + A and norm sums */
+    PHASE_REDUCE,    /* Reduction of the norm sums */
+    PHASE_BARRIER,   /* Waiting in MPI_Barrier for the slowest rank */
+    PHASE_HELPERS,   /* busy_wait_compute calls */
+    NUM_PHASES
+};
+const char* phase_names[NUM_PHASES] = {"init", "multiply", "panel bcast", "add+norms", "reduce", "barrier wait", "helpers"};
+double phase_time[NUM_PHASES];  /* Seconds this rank spent in each phase */
+
+/* Running sum with its accumulated rounding error (see compensated_add) */
+typedef struct {
+    double sum;
+    double c;
+} CompensatedSum;
+
+/* Sums of squares returned by the fused add (see matrix_add_norms) */
+typedef struct {
+    double sum_sq_a;  /* Of the first operand, A */
+    double sum_sq_c;  /* Of the result, C = A + B */
+} FusedNorms;
+
+/*
+ * 2D process grid: rank (r, c) owns block (r, c) of every matrix, with
+ * the rows split over dims[0] grid rows and the columns over dims[1]
+ * grid columns by compute_local_chunk
+ */
+typedef struct {
+    MPI_Comm comm;      /* Cartesian communicator of the grid */
+    MPI_Comm row_comm;  /* Ranks in this grid row, ranked by grid column */
+    MPI_Comm col_comm;  /* Ranks in this grid column, ranked by grid row */
+    int dims[2];        /* Grid rows and columns */
+    int coords[2];      /* Grid row and column of this rank */
+} ProcessGrid;
+
+/*
+ * GEMM tile sizes used by the blocked matrix multiply. A KC x NR sliver
+ * of the packed B panel should stay in L1, the packed MC x KC block of A
+ * in L2, and the KC x NC panel of B in L3. The defaults suit the caslake
+ * partition (Cascade Lake: 32 KB L1d and 1 MB L2 per core). Compile with
+ * -DGEMM_TUNE_AMD for the amd partition (EPYC Zen 2: 32 KB L1d, 512 KB L2),
+ * or set -DGEMM_MC=... -DGEMM_KC=... -DGEMM_NC=... to tune by hand.
+ */
+#ifdef GEMM_TUNE_AMD
+#define GEMM_MC_DEFAULT 128
+#define GEMM_KC_DEFAULT 256
+#define GEMM_NC_DEFAULT 4096
+#else
+#define GEMM_MC_DEFAULT 256
+#define GEMM_KC_DEFAULT 256
+#define GEMM_NC_DEFAULT 2048
+#endif
+#ifndef GEMM_MC
+#define GEMM_MC GEMM_MC_DEFAULT
+#endif
+#ifndef GEMM_KC
+#define GEMM_KC GEMM_KC_DEFAULT
+#endif
+#ifndef GEMM_NC
+#define GEMM_NC GEMM_NC_DEFAULT
+#endif
+#define FUSED_LANES 8  /* Partial sums per row in matrix_add_norms */
+#ifndef SUMMA_PANEL
+#define SUMMA_PANEL GEMM_KC  /* Columns of A (rows of B) broadcast per SUMMA step */
+#endif
+
+#define GEMM_NR 8       /* Columns of C per micro-kernel call (every kernel) */
+#define GEMM_MR_MAX 8   /* Largest number of rows of C per micro-kernel call */
+
+/*
+ * Micro-kernel: C[0..mr) x [0..GEMM_NR) += packed A sliver * packed B sliver,
+ * over kc steps. a holds mr values per step, b GEMM_NR values per step.
+ */
+typedef void (*GemmKernelFunc)(int kc, const double* a, const double* b, double* c, int ldc);
+
+typedef struct {
+    GemmKernelFunc func;
+    int mr;             /* Rows of C per call */
+    const char* name;
+} GemmKernel;
 
 /* Function prototypes */
+void set_profile_output(int rank);
+void timed_barrier(MPI_Comm comm);
+void print_phase_table(int rank, int size, MPI_Comm comm);
 void compute_local_chunk(int rank, int size, int global_n, int* local_start, int* local_end);
-double** allocate_matrix_local(int rows, int cols);
-void free_matrix_local(double** matrix, int rows);
-void initialize_matrix_local(double** matrix, int rows, int cols, double value);
-void matrix_multiply_local(double** A, double** B, double** C, int rows, int n);
-void matrix_add_local(double** A, double** B, double** C, int rows, int cols);
-double compute_local_norm(double** A, int rows, int cols);
+Matrix allocate_matrix_local(int rows, int cols);
+void free_matrix_local(Matrix* matrix);
+void initialize_matrix_local(Matrix* matrix, double value);
+void broadcast_matrix(Matrix* matrix, int root, MPI_Comm comm);
+void create_process_grid(int size, ProcessGrid* grid);
+void free_process_grid(ProcessGrid* grid);
+void matrix_multiply_local(const Matrix* A, const Matrix* B, Matrix* C);
+void matrix_multiply_summa(const Matrix* A, const Matrix* B, Matrix* C, const ProcessGrid* grid, int global_n);
+FusedNorms matrix_add_norms(const Matrix* A, const Matrix* B, Matrix* C);
+GemmKernel gemm_select_kernel(void);
+void gemm_kernel_generic(int kc, const double* a, const double* b, double* c, int ldc);
+#ifdef GEMM_X86_SIMD
+__attribute__((target("avx2,fma"))) void gemm_kernel_avx2(int kc, const double* a, const double* b, double* c, int ldc);
+__attribute__((target("avx512f"))) void gemm_kernel_avx512(int kc, const double* a, const double* b, double* c, int ldc);
+#endif
+void gemm_pack_a(const Matrix* A, int i0, int mc, int k0, int kc, int mr, double* packed);
+void gemm_pack_b(const Matrix* B, int k0, int kc, int j0, int nc, double* packed);
+void gemm_blocked(const Matrix* A, const Matrix* B, Matrix* C);
 void busy_wait_compute(int iterations);
 
 /*
- * Determine which rows this rank handles
+ * Pointer to the first element of row i
+ */
+static inline double* matrix_row(const Matrix* matrix, int i)
+{
+    return matrix->data + (size_t)i * matrix->stride;
+}
+
+/*
+ * Give each rank its own gprof output file
+ * - glibc writes the profile at exit to $GMON_OUT_PREFIX.<pid> if the
+ *   variable is set, else to gmon.out, which every rank would overwrite
+ * - The prefix becomes gmon.out.rank<N> (or <prefix>.rank<N> when the
+ *   user already set one), so the files sort and glob by rank
+ */
+void set_profile_output(int rank)
+{
+    char prefix[1024];
+    const char* user_prefix = getenv("GMON_OUT_PREFIX");
+    snprintf(prefix, sizeof(prefix), "%s.rank%d", user_prefix != NULL ? user_prefix : "gmon.out", rank);
+    setenv("GMON_OUT_PREFIX", prefix, 1);
+}
+
+/*
+ * MPI_Barrier, with the time spent waiting in it added to PHASE_BARRIER
+ */
+void timed_barrier(MPI_Comm comm)
+{
+    double t = MPI_Wtime();
+    MPI_Barrier(comm);
+    phase_time[PHASE_BARRIER] += MPI_Wtime() - t;
+}
+
+/*
+ * Print the min, average and max over the ranks of the time spent in
+ * each phase (rank 0 prints); max/avg well above 1 means load imbalance
+ */
+void print_phase_table(int rank, int size, MPI_Comm comm)
+{
+    double local[NUM_PHASES + 1], t_min[NUM_PHASES + 1], t_max[NUM_PHASES + 1], t_sum[NUM_PHASES + 1];
+    local[NUM_PHASES] = 0.0;  /* Total of the phases */
+    for (int p = 0; p < NUM_PHASES; p++) {
+        local[p] = phase_time[p];
+        local[NUM_PHASES] += phase_time[p];
+    }
+    MPI_Reduce(local, t_min, NUM_PHASES + 1, MPI_DOUBLE, MPI_MIN, 0, comm);
+    MPI_Reduce(local, t_max, NUM_PHASES + 1, MPI_DOUBLE, MPI_MAX, 0, comm);
+    MPI_Reduce(local, t_sum, NUM_PHASES + 1, MPI_DOUBLE, MPI_SUM, 0, comm);
+
+    if (rank == 0) {
+        printf("\n=== Phase times over %d ranks (MPI_Wtime, seconds) ===\n", size);
+        printf("%-14s %10s %10s %10s %8s\n", "Phase", "Min", "Avg", "Max", "Max/Avg");
+        for (int p = 0; p <= NUM_PHASES; p++) {
+            double avg = t_sum[p] / size;
+            printf("%-14s %10.4f %10.4f %10.4f %8.2f\n", p < NUM_PHASES ? phase_names[p] : "total",
+                   t_min[p], avg, t_max[p], avg > 0.0 ? t_max[p] / avg : 1.0);
+        }
+    }
+}
+
+/*
+ * Determine which rows this rank handles: block rank of size near-equal
+ * blocks of global_n (also used for the columns of the process grid)
  */
 void compute_local_chunk(int rank, int size, int global_n, int* local_start, int* local_end)
 {
@@ -46,21 +240,22 @@ void compute_local_chunk(int rank, int size, int global_n, int* local_start, int
 /*
  * Allocate a local portion of a matrix
  */
-double** allocate_matrix_local(int rows, int cols)
+Matrix allocate_matrix_local(int rows, int cols)
 {
-    double** matrix = (double**)malloc(rows * sizeof(double*));
-    if (matrix == NULL) {
+    const int line = MATRIX_ALIGN / sizeof(double);
+    Matrix matrix;
+    matrix.rows = rows;
+    matrix.cols = cols;
+    matrix.stride = (cols + line - 1) / line * line;
+
+    /* A rank may own no rows; keep a valid (one line) buffer anyway */
+    size_t count = (size_t)rows * matrix.stride;
+    void* data = NULL;
+    if (posix_memalign(&data, MATRIX_ALIGN, (count > 0 ? count : line) * sizeof(double)) != 0) {
         fprintf(stderr, "Memory allocation failed\n");
         exit(1);
     }
-
-    for (int i = 0; i < rows; i++) {
-        matrix[i] = (double*)malloc(cols * sizeof(double));
-        if (matrix[i] == NULL) {
-            fprintf(stderr, "Memory allocation failed\n");
-            exit(1);
-        }
-    }
+    matrix.data = (double*)data;
 
     return matrix;
 }
@@ -68,68 +263,426 @@ double** allocate_matrix_local(int rows, int cols)
 /*
  * Free a local matrix
  */
-void free_matrix_local(double** matrix, int rows)
+void free_matrix_local(Matrix* matrix)
 {
-    for (int i = 0; i < rows; i++) {
-        free(matrix[i]);
-    }
-    free(matrix);
+    free(matrix->data);
+    matrix->data = NULL;
 }
 
 /*
  * Initialize local matrix with a value
+ * - The row padding is zeroed too, so whole rows can be processed
  */
-void initialize_matrix_local(double** matrix, int rows, int cols, double value)
+void initialize_matrix_local(Matrix* matrix, double value)
 {
-    for (int i = 0; i < rows; i++) {
-        for (int j = 0; j < cols; j++) {
-            matrix[i][j] = value;
+    for (int i = 0; i < matrix->rows; i++) {
+        double* row = matrix_row(matrix, i);
+        for (int j = 0; j < matrix->cols; j++) {
+            row[j] = value;
+        }
+        for (int j = matrix->cols; j < matrix->stride; j++) {
+            row[j] = 0.0;
         }
     }
 }
 
 /*
- * Local matrix multiplication: C_local = A_local * B
+ * Broadcast a whole matrix from root in one call
+ * - The buffer is contiguous, padding included, so no packing is needed
+ */
+void broadcast_matrix(Matrix* matrix, int root, MPI_Comm comm)
+{
+    MPI_Bcast(matrix->data, matrix->rows * matrix->stride, MPI_DOUBLE, root, comm);
+}
+
+/*
+ * Arrange the ranks in a near-square 2D grid and build the row and
+ * column communicators SUMMA broadcasts over
+ */
+void create_process_grid(int size, ProcessGrid* grid)
+{
+    int periods[2] = {0, 0};
+    int row_dims[2] = {0, 1};  /* Keep the column dimension: ranks sharing a grid row */
+    int col_dims[2] = {1, 0};
+
+    grid->dims[0] = 0;
+    grid->dims[1] = 0;
+    MPI_Dims_create(size, 2, grid->dims);
+    MPI_Cart_create(MPI_COMM_WORLD, 2, grid->dims, periods, 1, &grid->comm);
+
+    int grid_rank;
+    MPI_Comm_rank(grid->comm, &grid_rank);
+    MPI_Cart_coords(grid->comm, grid_rank, 2, grid->coords);
+    MPI_Cart_sub(grid->comm, row_dims, &grid->row_comm);
+    MPI_Cart_sub(grid->comm, col_dims, &grid->col_comm);
+}
+
+/*
+ * Free the communicators of a process grid
+ */
+void free_process_grid(ProcessGrid* grid)
+{
+    MPI_Comm_free(&grid->row_comm);
+    MPI_Comm_free(&grid->col_comm);
+    MPI_Comm_free(&grid->comm);
+}
+
+/*
+ * Distributed matrix multiplication with SUMMA: C = A * B
  * - COMPUTE INTENSIVE operation (HOTSPOT)
- * - Each rank computes its portion of rows
+ * - A, B and C are this rank's blocks of n x n matrices on the grid
+ * - k runs over panels of up to SUMMA_PANEL columns of A and rows of B.
+ *   For each panel, the grid column owning those columns of A broadcasts
+ *   them along every grid row, the grid row owning those rows of B
+ *   broadcasts them along every grid column, and each rank adds the
+ *   product of the two panels to its block of C
+ * - A rank holds one block of each matrix and two panels, so memory and
+ *   traffic per rank fall as ranks are added
+ */
+void matrix_multiply_summa(const Matrix* A, const Matrix* B, Matrix* C, const ProcessGrid* grid, int global_n)
+{
+    Matrix a_panel = allocate_matrix_local(A->rows, SUMMA_PANEL);
+    Matrix b_panel = allocate_matrix_local(SUMMA_PANEL, B->cols);
+    int a_owner = 0, a_start, a_end;  /* Grid column owning columns [a_start, a_end) of A */
+    int b_owner = 0, b_start, b_end;  /* Grid row owning rows [b_start, b_end) of B */
+    compute_local_chunk(a_owner, grid->dims[1], global_n, &a_start, &a_end);
+    compute_local_chunk(b_owner, grid->dims[0], global_n, &b_start, &b_end);
+
+    for (int i = 0; i < C->rows; i++) {
+        memset(matrix_row(C, i), 0, C->cols * sizeof(double));
+    }
+
+    for (int k = 0; k < global_n;) {
+        while (k >= a_end) {
+            compute_local_chunk(++a_owner, grid->dims[1], global_n, &a_start, &a_end);
+        }
+        while (k >= b_end) {
+            compute_local_chunk(++b_owner, grid->dims[0], global_n, &b_start, &b_end);
+        }
+        /* The panel must not cross into the next block of either owner */
+        int kb = SUMMA_PANEL;
+        if (a_end - k < kb) kb = a_end - k;
+        if (b_end - k < kb) kb = b_end - k;
+
+        /* Columns [k, k + kb) of A, copied into a contiguous panel by their owner */
+        a_panel.cols = kb;
+        if (grid->coords[1] == a_owner) {
+            for (int i = 0; i < A->rows; i++) {
+                memcpy(matrix_row(&a_panel, i), matrix_row(A, i) + (k - a_start), kb * sizeof(double));
+            }
+        }
+        double t = MPI_Wtime();
+        broadcast_matrix(&a_panel, a_owner, grid->row_comm);
+
+        /* Rows [k, k + kb) of B are contiguous already, so the owner sends them in place */
+        Matrix b_rows = b_panel;
+        b_rows.rows = kb;
+        if (grid->coords[0] == b_owner) {
+            b_rows.data = matrix_row(B, k - b_start);
+        }
+        broadcast_matrix(&b_rows, b_owner, grid->col_comm);
+        phase_time[PHASE_BCAST] += MPI_Wtime() - t;
+
+        t = MPI_Wtime();
+        matrix_multiply_local(&a_panel, &b_rows, C);
+        phase_time[PHASE_MULTIPLY] += MPI_Wtime() - t;
+        k += kb;
+    }
+
+    free_matrix_local(&a_panel);
+    free_matrix_local(&b_panel);
+}
+
+/*
+ * Local matrix multiplication: C += A * B
+ * - The work of each SUMMA step on one rank
+ * - Runs the cache-blocked GEMM below (or BLAS dgemm with -DUSE_CBLAS)
+ */
+void matrix_multiply_local(const Matrix* A, const Matrix* B, Matrix* C)
+{
+#ifdef USE_CBLAS
+    cblas_dgemm(CblasRowMajor, CblasNoTrans, CblasNoTrans, C->rows, C->cols, A->cols,
+                1.0, A->data, A->stride, B->data, B->stride, 1.0, C->data, C->stride);
+#else
+    gemm_blocked(A, B, C);
+#endif
+}
+
+/*
+ * Portable micro-kernel: 4 x GEMM_NR block of C
+ */
+void gemm_kernel_generic(int kc, const double* a, const double* b, double* c, int ldc)
+{
+    double acc[4][GEMM_NR] = {{0.0}};
+    for (int p = 0; p < kc; p++) {
+        for (int r = 0; r < 4; r++) {
+            for (int j = 0; j < GEMM_NR; j++) {
+                acc[r][j] += a[r] * b[j];
+            }
+        }
+        a += 4;
+        b += GEMM_NR;
+    }
+    for (int r = 0; r < 4; r++) {
+        for (int j = 0; j < GEMM_NR; j++) {
+            c[(size_t)r * ldc + j] += acc[r][j];
+        }
+    }
+}
+
+#ifdef GEMM_X86_SIMD
+/*
+ * AVX2 micro-kernel: 4 x 8 block of C in eight 4-wide FMA accumulators
+ */
+__attribute__((target("avx2,fma")))
+void gemm_kernel_avx2(int kc, const double* a, const double* b, double* c, int ldc)
+{
+    __m256d c00 = _mm256_setzero_pd(), c01 = _mm256_setzero_pd();
+    __m256d c10 = _mm256_setzero_pd(), c11 = _mm256_setzero_pd();
+    __m256d c20 = _mm256_setzero_pd(), c21 = _mm256_setzero_pd();
+    __m256d c30 = _mm256_setzero_pd(), c31 = _mm256_setzero_pd();
+    for (int p = 0; p < kc; p++) {
+        __m256d b0 = _mm256_load_pd(b);
+        __m256d b1 = _mm256_load_pd(b + 4);
+        __m256d a0 = _mm256_broadcast_sd(a);
+        __m256d a1 = _mm256_broadcast_sd(a + 1);
+        c00 = _mm256_fmadd_pd(a0, b0, c00);
+        c01 = _mm256_fmadd_pd(a0, b1, c01);
+        c10 = _mm256_fmadd_pd(a1, b0, c10);
+        c11 = _mm256_fmadd_pd(a1, b1, c11);
+        __m256d a2 = _mm256_broadcast_sd(a + 2);
+        __m256d a3 = _mm256_broadcast_sd(a + 3);
+        c20 = _mm256_fmadd_pd(a2, b0, c20);
+        c21 = _mm256_fmadd_pd(a2, b1, c21);
+        c30 = _mm256_fmadd_pd(a3, b0, c30);
+        c31 = _mm256_fmadd_pd(a3, b1, c31);
+        a += 4;
+        b += 8;
+    }
+    double* c0 = c;
+    double* c1 = c + ldc;
+    double* c2 = c + 2 * (size_t)ldc;
+    double* c3 = c + 3 * (size_t)ldc;
+    _mm256_storeu_pd(c0, _mm256_add_pd(_mm256_loadu_pd(c0), c00));
+    _mm256_storeu_pd(c0 + 4, _mm256_add_pd(_mm256_loadu_pd(c0 + 4), c01));
+    _mm256_storeu_pd(c1, _mm256_add_pd(_mm256_loadu_pd(c1), c10));
+    _mm256_storeu_pd(c1 + 4, _mm256_add_pd(_mm256_loadu_pd(c1 + 4), c11));
+    _mm256_storeu_pd(c2, _mm256_add_pd(_mm256_loadu_pd(c2), c20));
+    _mm256_storeu_pd(c2 + 4, _mm256_add_pd(_mm256_loadu_pd(c2 + 4), c21));
+    _mm256_storeu_pd(c3, _mm256_add_pd(_mm256_loadu_pd(c3), c30));
+    _mm256_storeu_pd(c3 + 4, _mm256_add_pd(_mm256_loadu_pd(c3 + 4), c31));
+}
+
+/*
+ * AVX-512 micro-kernel: 8 x 8 block of C in eight 8-wide FMA accumulators
+ */
+__attribute__((target("avx512f")))
+void gemm_kernel_avx512(int kc, const double* a, const double* b, double* c, int ldc)
+{
+    __m512d acc[8];
+    for (int r = 0; r < 8; r++) {
+        acc[r] = _mm512_setzero_pd();
+    }
+    for (int p = 0; p < kc; p++) {
+        __m512d bv = _mm512_load_pd(b);
+        for (int r = 0; r < 8; r++) {
+            acc[r] = _mm512_fmadd_pd(_mm512_set1_pd(a[r]), bv, acc[r]);
+        }
+        a += 8;
+        b += 8;
+    }
+    for (int r = 0; r < 8; r++) {
+        double* cr = c + (size_t)r * ldc;
+        _mm512_storeu_pd(cr, _mm512_add_pd(_mm512_loadu_pd(cr), acc[r]));
+    }
+}
+#endif
+
+/*
+ * Pick the widest micro-kernel this CPU supports
+ */
+GemmKernel gemm_select_kernel(void)
+{
+    GemmKernel kernel = {gemm_kernel_generic, 4, "generic 4x8"};
+#ifdef GEMM_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        kernel.func = gemm_kernel_avx512;
+        kernel.mr = 8;
+        kernel.name = "AVX-512 8x8";
+    } else if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        kernel.func = gemm_kernel_avx2;
+        kernel.mr = 4;
+        kernel.name = "AVX2 4x8";
+    }
+#endif
+    return kernel;
+}
+
+/*
+ * Pack the mc x kc block of A at (i0, k0) into mr-row slivers: for each
+ * sliver, the mr values of column k are consecutive, one k after another.
+ * Rows past the end of the block are zero, so edge tiles need no special case.
+ */
+void gemm_pack_a(const Matrix* A, int i0, int mc, int k0, int kc, int mr, double* packed)
+{
+    for (int ir = 0; ir < mc; ir += mr) {
+        for (int p = 0; p < kc; p++) {
+            for (int r = 0; r < mr; r++) {
+                *packed++ = (ir + r < mc) ? A->data[(size_t)(i0 + ir + r) * A->stride + k0 + p] : 0.0;
+            }
+        }
+    }
+}
+
+/*
+ * Pack the kc x nc panel of B at (k0, j0) into GEMM_NR-column slivers:
+ * for each sliver, the GEMM_NR values of row k are consecutive. Columns
+ * past the end of the panel are zero.
  */
-void matrix_multiply_local(double** A, double** B, double** C, int rows, int n)
+void gemm_pack_b(const Matrix* B, int k0, int kc, int j0, int nc, double* packed)
 {
-    for (int i = 0; i < rows; i++) {
-        for (int j = 0; j < n; j++) {
-            C[i][j] = 0.0;
-            for (int k = 0; k < n; k++) {
-                C[i][j] += A[i][k] * B[k][j];
+    for (int jr = 0; jr < nc; jr += GEMM_NR) {
+        int nr = (nc - jr < GEMM_NR) ? nc - jr : GEMM_NR;
+        for (int p = 0; p < kc; p++) {
+            const double* b = B->data + (size_t)(k0 + p) * B->stride + j0 + jr;
+            for (int j = 0; j < nr; j++) {
+                packed[j] = b[j];
+            }
+            for (int j = nr; j < GEMM_NR; j++) {
+                packed[j] = 0.0;
             }
+            packed += GEMM_NR;
         }
     }
 }
 
 /*
- * Local matrix addition: C = A + B
- * - MODERATE operation
+ * Cache-blocked GEMM: C += A * B
+ * - Loops over NC-column panels of B and KC-deep slices of k, packing each
+ *   B panel once, then over MC-row blocks of A, packing each block once
+ * - The micro-kernel then streams the packed slivers from L1/L2 into
+ *   register tiles of C; partial tiles at the edges go through a buffer
  */
-void matrix_add_local(double** A, double** B, double** C, int rows, int cols)
+void gemm_blocked(const Matrix* A, const Matrix* B, Matrix* C)
 {
-    for (int i = 0; i < rows; i++) {
-        for (int j = 0; j < cols; j++) {
-            C[i][j] = A[i][j] + B[i][j];
+    static GemmKernel kernel = {NULL, 0, NULL};
+    if (kernel.func == NULL) {
+        kernel = gemm_select_kernel();
+    }
+    const int m = C->rows, n = C->cols, k = A->cols;
+    const int mr = kernel.mr;
+    const int mc_max = (GEMM_MC + mr - 1) / mr * mr;
+    const int nc_max = (GEMM_NC + GEMM_NR - 1) / GEMM_NR * GEMM_NR;
+
+    double* packed_a = NULL;
+    double* packed_b = NULL;
+    if (posix_memalign((void**)&packed_a, MATRIX_ALIGN, (size_t)mc_max * GEMM_KC * sizeof(double)) != 0
+        || posix_memalign((void**)&packed_b, MATRIX_ALIGN, (size_t)nc_max * GEMM_KC * sizeof(double)) != 0) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+
+    for (int j0 = 0; j0 < n; j0 += GEMM_NC) {
+        int nc = (n - j0 < GEMM_NC) ? n - j0 : GEMM_NC;
+        for (int k0 = 0; k0 < k; k0 += GEMM_KC) {
+            int kc = (k - k0 < GEMM_KC) ? k - k0 : GEMM_KC;
+            gemm_pack_b(B, k0, kc, j0, nc, packed_b);
+            for (int i0 = 0; i0 < m; i0 += GEMM_MC) {
+                int mc = (m - i0 < GEMM_MC) ? m - i0 : GEMM_MC;
+                gemm_pack_a(A, i0, mc, k0, kc, mr, packed_a);
+                for (int jr = 0; jr < nc; jr += GEMM_NR) {
+                    const double* b = packed_b + (size_t)jr * kc;
+                    for (int ir = 0; ir < mc; ir += mr) {
+                        const double* a = packed_a + (size_t)ir * kc;
+                        double* c = matrix_row(C, i0 + ir) + j0 + jr;
+                        if (mc - ir >= mr && nc - jr >= GEMM_NR) {
+                            kernel.func(kc, a, b, c, C->stride);
+                        } else {
+                            /* Edge tile: compute the full tile aside, keep the part inside C */
+                            double tile[GEMM_MR_MAX * GEMM_NR] __attribute__((aligned(MATRIX_ALIGN))) = {0.0};
+                            int rows = (mc - ir < mr) ? mc - ir : mr;
+                            int cols = (nc - jr < GEMM_NR) ? nc - jr : GEMM_NR;
+                            kernel.func(kc, a, b, tile, GEMM_NR);
+                            for (int r = 0; r < rows; r++) {
+                                for (int j = 0; j < cols; j++) {
+                                    c[(size_t)r * C->stride + j] += tile[r * GEMM_NR + j];
+                                }
+                            }
+                        }
+                    }
+                }
+            }
         }
     }
+
+    free(packed_a);
+    free(packed_b);
+}
+
+/*
+ * Add x to a compensated sum (Neumaier's variant of Kahan summation):
+ * the rounding error of every addition is kept in c and added back at the end
+ */
+static inline void compensated_add(CompensatedSum* s, double x)
+{
+    double t = s->sum + x;
+    if (fabs(s->sum) >= fabs(x)) {
+        s->c += (s->sum - t) + x;
+    } else {
+        s->c += (x - t) + s->sum;
+    }
+    s->sum = t;
 }
 
 /*
- * Compute local Frobenius norm contribution
+ * Fused matrix addition and norms: C = A + B, in one pass over memory
+ * - MODERATE operation (O(n^2)), bound by memory bandwidth
+ * - Returns the sums of squares of A and of C, so the Frobenius norms of
+ *   both need no further pass: norms = matrix_add_norms(&A, &B, &C)
+ * - Each row is summed in FUSED_LANES independent partial sums (which the
+ *   compiler keeps in SIMD registers) combined pairwise; the row sums
+ *   are then added with compensated summation
  */
-double compute_local_norm(double** A, int rows, int cols)
+FusedNorms matrix_add_norms(const Matrix* A, const Matrix* B, Matrix* C)
 {
-    double sum = 0.0;
-    for (int i = 0; i < rows; i++) {
-        for (int j = 0; j < cols; j++) {
-            sum += A[i][j] * A[i][j];
+    CompensatedSum sum_a = {0.0, 0.0}, sum_c = {0.0, 0.0};
+    for (int i = 0; i < C->rows; i++) {
+        const double* a = matrix_row(A, i);
+        const double* b = matrix_row(B, i);
+        double* c = matrix_row(C, i);
+        double lane_a[FUSED_LANES] = {0.0}, lane_c[FUSED_LANES] = {0.0};
+        int j = 0;
+        for (; j + FUSED_LANES <= C->cols; j += FUSED_LANES) {
+            for (int l = 0; l < FUSED_LANES; l++) {
+                double x = a[j + l];
+                double y = x + b[j + l];
+                c[j + l] = y;
+                lane_a[l] += x * x;
+                lane_c[l] += y * y;
+            }
+        }
+        for (int l = 0; j < C->cols; j++, l++) {
+            double x = a[j];
+            double y = x + b[j];
+            c[j] = y;
+            lane_a[l] += x * x;
+            lane_c[l] += y * y;
         }
+        for (int width = FUSED_LANES / 2; width > 0; width /= 2) {
+            for (int l = 0; l < width; l++) {
+                lane_a[l] += lane_a[l + width];
+                lane_c[l] += lane_c[l + width];
+            }
+        }
+        compensated_add(&sum_a, lane_a[0]);
+        compensated_add(&sum_c, lane_c[0]);
     }
-    return sum;
+
+    FusedNorms norms;
+    norms.sum_sq_a = sum_a.sum + sum_a.c;
+    norms.sum_sq_c = sum_c.sum + sum_c.c;
+    return norms;
 }
 
 /*
@@ -153,13 +706,15 @@ int main(int argc, char* argv[])
 {
     int rank, size;
     int global_n = 500;  /* Default global matrix size */
-    int local_start, local_end, local_rows;
+    int row_start, row_end, col_start, col_end;
+    int local_rows, local_cols;
     double t_start, t_end;
 
     /* Initialize MPI */
     MPI_Init(&argc, &argv);
     MPI_Comm_rank(MPI_COMM_WORLD, &rank);
     MPI_Comm_size(MPI_COMM_WORLD, &size);
+    set_profile_output(rank);
 
     /* Parse command line arguments */
     if (argc > 1) {
@@ -173,46 +728,59 @@ int main(int argc, char* argv[])
         }
     }
 
-    /* Compute local chunk */
-    compute_local_chunk(rank, size, global_n, &local_start, &local_end);
-    local_rows = local_end - local_start;
+    /* Place the ranks on a 2D grid and find this rank's block */
+    ProcessGrid grid;
+    create_process_grid(size, &grid);
+    compute_local_chunk(grid.coords[0], grid.dims[0], global_n, &row_start, &row_end);
+    compute_local_chunk(grid.coords[1], grid.dims[1], global_n, &col_start, &col_end);
+    local_rows = row_end - row_start;
+    local_cols = col_end - col_start;
 
     /* Print header from rank 0 */
     if (rank == 0) {
         printf("=== gprof MPI Example ===\n");
         printf("Global matrix size: %d x %d\n", global_n, global_n);
         printf("Number of MPI ranks: %d\n", size);
+        printf("Process grid: %d x %d (blocks of about %d x %d)\n", grid.dims[0], grid.dims[1],
+               global_n / grid.dims[0], global_n / grid.dims[1]);
+#ifdef USE_CBLAS
+        printf("GEMM: BLAS dgemm\n");
+#else
+        printf("GEMM: blocked, %s kernel, MC=%d KC=%d NC=%d\n", gemm_select_kernel().name, GEMM_MC, GEMM_KC, GEMM_NC);
+#endif
         printf("\nNote: For accurate gprof profiling with MPI:\n");
-        printf("1. Rename gmon.out after each run (per rank)\n");
+        printf("1. Each rank writes its own profile: %s.<pid>\n", getenv("GMON_OUT_PREFIX"));
         printf("2. Profile with a single rank: srun -n1 ./mpi_example\n");
         printf("3. Or analyze a representative rank\n\n");
     }
 
-    /* Allocate local matrices */
-    double** A_local = allocate_matrix_local(local_rows, global_n);
-    double** B = allocate_matrix_local(global_n, global_n);
-    double** C_local = allocate_matrix_local(local_rows, global_n);
-    double** D_local = allocate_matrix_local(local_rows, global_n);
+    /* Allocate this rank's block of each matrix */
+    double t_phase = MPI_Wtime();
+    Matrix A_local = allocate_matrix_local(local_rows, local_cols);
+    Matrix B_local = allocate_matrix_local(local_rows, local_cols);
+    Matrix C_local = allocate_matrix_local(local_rows, local_cols);
+    Matrix D_local = allocate_matrix_local(local_rows, local_cols);
 
     /* Initialize matrices */
     if (rank == 0) {
         printf("Initializing matrices...\n");
     }
 
-    initialize_matrix_local(A_local, local_rows, global_n, 1.0);
-    initialize_matrix_local(B, global_n, global_n, 2.0);
-    initialize_matrix_local(C_local, local_rows, global_n, 0.0);
-    initialize_matrix_local(D_local, local_rows, global_n, 0.0);
+    initialize_matrix_local(&A_local, 1.0);
+    initialize_matrix_local(&B_local, 2.0);
+    initialize_matrix_local(&C_local, 0.0);
+    initialize_matrix_local(&D_local, 0.0);
+    phase_time[PHASE_INIT] = MPI_Wtime() - t_phase;
 
     /* Perform matrix multiplication (HOTSPOT) */
     if (rank == 0) {
         printf("Computing C = A * B (this is the HOTSPOT)...\n");
     }
 
-    MPI_Barrier(MPI_COMM_WORLD);
+    timed_barrier(MPI_COMM_WORLD);
     t_start = MPI_Wtime();
 
-    matrix_multiply_local(A_local, B, C_local, local_rows, global_n);
+    matrix_multiply_summa(&A_local, &B_local, &C_local, &grid, global_n);
 
     t_end = MPI_Wtime();
 
@@ -220,26 +788,26 @@ int main(int argc, char* argv[])
         printf("Matrix multiplication time: %.4f seconds\n", t_end - t_start);
     }
 
-    /* Perform matrix addition */
+    /* Perform matrix addition; the local norm sums come out of the same pass */
     if (rank == 0) {
-        printf("Computing D = C + A...\n");
+        printf("Computing D = C + A and the global Frobenius norms...\n");
     }
 
-    matrix_add_local(C_local, A_local, D_local, local_rows, global_n);
+    t_phase = MPI_Wtime();
+    FusedNorms norms = matrix_add_norms(&C_local, &A_local, &D_local);
+    phase_time[PHASE_ADD_NORM] = MPI_Wtime() - t_phase;
 
-    /* Compute global norm */
-    if (rank == 0) {
-        printf("Computing global Frobenius norm...\n");
-    }
+    /* Both sums of squares go to rank 0 in one reduction */
+    double local_sums[2] = {norms.sum_sq_a, norms.sum_sq_c};
+    double global_sums[2];
 
-    double local_norm = compute_local_norm(C_local, local_rows, global_n);
-    double global_norm;
-
-    MPI_Reduce(&local_norm, &global_norm, 1, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+    t_phase = MPI_Wtime();
+    MPI_Reduce(local_sums, global_sums, 2, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+    phase_time[PHASE_REDUCE] = MPI_Wtime() - t_phase;
 
     if (rank == 0) {
-        global_norm = sqrt(global_norm);
-        printf("||C||_F = %.4f\n", global_norm);
+        printf("||C||_F = %.4f\n", sqrt(global_sums[0]));
+        printf("||D||_F = %.4f\n", sqrt(global_sums[1]));
     }
 
     /* Call helper functions */
@@ -247,29 +815,37 @@ int main(int argc, char* argv[])
         printf("\nCalling helper functions multiple times...\n");
     }
 
-    MPI_Barrier(MPI_COMM_WORLD);
+    timed_barrier(MPI_COMM_WORLD);
 
+    t_phase = MPI_Wtime();
     for (int i = 0; i < 10; i++) {
         busy_wait_compute(10000);
     }
+    phase_time[PHASE_HELPERS] = MPI_Wtime() - t_phase;
+    timed_barrier(MPI_COMM_WORLD);
+
+    /* Per-phase load balance across the ranks */
+    print_phase_table(rank, size, MPI_COMM_WORLD);
 
     /* Clean up */
-    free_matrix_local(A_local, local_rows);
-    free_matrix_local(B, global_n);
-    free_matrix_local(C_local, local_rows);
-    free_matrix_local(D_local, local_rows);
+    free_matrix_local(&A_local);
+    free_matrix_local(&B_local);
+    free_matrix_local(&C_local);
+    free_matrix_local(&D_local);
 
     /* Print completion message */
     if (rank == 0) {
         printf("\n=== Profiling complete ===\n");
-        printf("\nTo analyze gprof output for this rank:\n");
-        printf("  mv gmon.out gmon.out.rank0\n");
-        printf("  gprof mpi_example gmon.out.rank0 > profile_rank0.txt\n");
+        printf("\nTo analyze gprof output for one rank:\n");
+        printf("  gprof mpi_example gmon.out.rank0.* > profile_rank0.txt\n");
+        printf("To sum the profiles of all ranks:\n");
+        printf("  gprof -s mpi_example gmon.out.rank*.* && gprof mpi_example gmon.sum > profile_all.txt\n");
         printf("\nFor single-rank profiling (recommended):\n");
         printf("  srun -n1 ./mpi_example\n");
-        printf("  gprof mpi_example gmon.out > profile.txt\n");
+        printf("  gprof mpi_example gmon.out.rank0.* > profile.txt\n");
     }
 
+    free_process_grid(&grid);
     MPI_Finalize();
     return 0;
 }
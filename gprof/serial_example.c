@@ -12,38 +12,140 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
 #include <time.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define GEMM_X86_SIMD 1  /* Build the AVX2/AVX-512 kernels; used only if the CPU has them */
+#include <immintrin.h>
+#endif
+/*
+ * With -DUSE_CBLAS matrix_multiply calls the vendor BLAS dgemm instead
+ * (link with e.g. -lopenblas or -lmkl_rt), as a reference for the blocked kernel.
+ */
+#ifdef USE_CBLAS
+#include <cblas.h>
+#endif
+
+#define MATRIX_ALIGN 64  /* Alignment of matrix buffers and rows in bytes (one cache line) */
+
+/*
+ * Dense matrix in row-major order, held in one contiguous buffer
+ * aligned to MATRIX_ALIGN. Rows are padded to stride doubles, a
+ * multiple of the cache line, so every row starts on a cache-line
+ * boundary too. Element (i, j) is data[i * stride + j].
+ */
+typedef struct {
+    int rows;
+    int cols;
+    int stride;     /* Doubles from the start of one row to the next */
+    double* data;
+} Matrix;
+
+/* Running sum with its accumulated rounding error (see compensated_add) */
+typedef struct {
+    double sum;
+    double c;
+} CompensatedSum;
+
+/* Sums of squares returned by the fused add (see matrix_add_norms) */
+typedef struct {
+    double sum_sq_a;  /* Of the first operand, A */
+    double sum_sq_c;  /* Of the result, C = A + B */
+} FusedNorms;
+
+/*
+ * GEMM tile sizes used by the blocked matrix multiply. A KC x NR sliver
+ * of the packed B panel should stay in L1, the packed MC x KC block of A
+ * in L2, and the KC x NC panel of B in L3. The defaults suit the caslake
+ * partition (Cascade Lake: 32 KB L1d and 1 MB L2 per core). Compile with
+ * -DGEMM_TUNE_AMD for the amd partition (EPYC Zen 2: 32 KB L1d, 512 KB L2),
+ * or set -DGEMM_MC=... -DGEMM_KC=... -DGEMM_NC=... to tune by hand.
+ */
+#ifdef GEMM_TUNE_AMD
+#define GEMM_MC_DEFAULT 128
+#define GEMM_KC_DEFAULT 256
+#define GEMM_NC_DEFAULT 4096
+#else
+#define GEMM_MC_DEFAULT 256
+#define GEMM_KC_DEFAULT 256
+#define GEMM_NC_DEFAULT 2048
+#endif
+#ifndef GEMM_MC
+#define GEMM_MC GEMM_MC_DEFAULT
+#endif
+#ifndef GEMM_KC
+#define GEMM_KC GEMM_KC_DEFAULT
+#endif
+#ifndef GEMM_NC
+#define GEMM_NC GEMM_NC_DEFAULT
+#endif
+#define FUSED_LANES 8  /* Partial sums per row in matrix_add_norms */
+#define TRANSPOSE_BLOCK 32  /* Side of the leaf tiles of the recursive transposes */
+
+#define GEMM_NR 8       /* Columns of C per micro-kernel call (every kernel) */
+#define GEMM_MR_MAX 8   /* Largest number of rows of C per micro-kernel call */
+
+/*
+ * Micro-kernel: C[0..mr) x [0..GEMM_NR) += packed A sliver * packed B sliver,
+ * over kc steps. a holds mr values per step, b GEMM_NR values per step.
+ */
+typedef void (*GemmKernelFunc)(int kc, const double* a, const double* b, double* c, int ldc);
+
+typedef struct {
+    GemmKernelFunc func;
+    int mr;             /* Rows of C per call */
+    const char* name;
+} GemmKernel;
 
 /* Function prototypes */
-double** allocate_matrix(int n);
-void free_matrix(double** matrix, int n);
-void initialize_matrix(double** matrix, int n, double value);
-void matrix_multiply(double** A, double** B, double** C, int n);
-void matrix_add(double** A, double** B, double** C, int n);
-void matrix_transpose(double** A, double** AT, int n);
-double compute_frobenius_norm(double** A, int n);
-void print_matrix(double** matrix, int n, const char* name);
+Matrix allocate_matrix(int n);
+void free_matrix(Matrix* matrix);
+void initialize_matrix(Matrix* matrix, double value);
+void matrix_multiply(const Matrix* A, const Matrix* B, Matrix* C);
+FusedNorms matrix_add_norms(const Matrix* A, const Matrix* B, Matrix* C);
+void matrix_transpose(const Matrix* A, Matrix* AT);
+void matrix_transpose_inplace(Matrix* A);
+void transpose_block(const Matrix* A, Matrix* AT, int i0, int i1, int j0, int j1);
+void transpose_swap(Matrix* A, int i0, int i1, int j0, int j1);
+void transpose_diagonal(Matrix* A, int i0, int i1);
+void print_matrix(const Matrix* matrix, const char* name);
+GemmKernel gemm_select_kernel(void);
+void gemm_kernel_generic(int kc, const double* a, const double* b, double* c, int ldc);
+#ifdef GEMM_X86_SIMD
+__attribute__((target("avx2,fma"))) void gemm_kernel_avx2(int kc, const double* a, const double* b, double* c, int ldc);
+__attribute__((target("avx512f"))) void gemm_kernel_avx512(int kc, const double* a, const double* b, double* c, int ldc);
+#endif
+void gemm_pack_a(const Matrix* A, int i0, int mc, int k0, int kc, int mr, double* packed);
+void gemm_pack_b(const Matrix* B, int k0, int kc, int j0, int nc, double* packed);
+void gemm_blocked(const Matrix* A, const Matrix* B, Matrix* C);
 void busy_wait_function(int iterations);
 void lightweight_function(int iterations);
 
+/*
+ * Pointer to the first element of row i
+ */
+static inline double* matrix_row(const Matrix* matrix, int i)
+{
+    return matrix->data + (size_t)i * matrix->stride;
+}
+
 /*
  * Allocate a n x n matrix
  */
-double** allocate_matrix(int n)
+Matrix allocate_matrix(int n)
 {
-    double** matrix = (double**)malloc(n * sizeof(double*));
-    if (matrix == NULL) {
+    const int line = MATRIX_ALIGN / sizeof(double);
+    Matrix matrix;
+    matrix.rows = n;
+    matrix.cols = n;
+    matrix.stride = (n + line - 1) / line * line;
+
+    void* data = NULL;
+    if (posix_memalign(&data, MATRIX_ALIGN, (size_t)matrix.rows * matrix.stride * sizeof(double)) != 0) {
         fprintf(stderr, "Memory allocation failed\n");
         exit(1);
     }
-
-    for (int i = 0; i < n; i++) {
-        matrix[i] = (double*)malloc(n * sizeof(double));
-        if (matrix[i] == NULL) {
-            fprintf(stderr, "Memory allocation failed\n");
-            exit(1);
-        }
-    }
+    matrix.data = (double*)data;
 
     return matrix;
 }
@@ -51,23 +153,26 @@ double** allocate_matrix(int n)
 /*
  * Free a matrix
  */
-void free_matrix(double** matrix, int n)
+void free_matrix(Matrix* matrix)
 {
-    for (int i = 0; i < n; i++) {
-        free(matrix[i]);
-    }
-    free(matrix);
+    free(matrix->data);
+    matrix->data = NULL;
 }
 
 /*
  * Initialize matrix with a value
  * - LIGHTWEIGHT operation
+ * - The row padding is zeroed too, so whole rows can be processed
  */
-void initialize_matrix(double** matrix, int n, double value)
+void initialize_matrix(Matrix* matrix, double value)
 {
-    for (int i = 0; i < n; i++) {
-        for (int j = 0; j < n; j++) {
-            matrix[i][j] = value;
+    for (int i = 0; i < matrix->rows; i++) {
+        double* row = matrix_row(matrix, i);
+        for (int j = 0; j < matrix->cols; j++) {
+            row[j] = value;
+        }
+        for (int j = matrix->cols; j < matrix->stride; j++) {
+            row[j] = 0.0;
         }
     }
 }
@@ -76,75 +181,414 @@ void initialize_matrix(double** matrix, int n, double value)
  * Matrix multiplication: C = A * B
  * - COMPUTE INTENSIVE operation (O(n^3))
  * - This should appear as a HOTSPOT in the profile
+ * - Runs the cache-blocked GEMM below (or BLAS dgemm with -DUSE_CBLAS)
+ */
+void matrix_multiply(const Matrix* A, const Matrix* B, Matrix* C)
+{
+#ifdef USE_CBLAS
+    cblas_dgemm(CblasRowMajor, CblasNoTrans, CblasNoTrans, C->rows, C->cols, A->cols,
+                1.0, A->data, A->stride, B->data, B->stride, 0.0, C->data, C->stride);
+#else
+    for (int i = 0; i < C->rows; i++) {
+        memset(matrix_row(C, i), 0, C->cols * sizeof(double));
+    }
+    gemm_blocked(A, B, C);
+#endif
+}
+
+/*
+ * Portable micro-kernel: 4 x GEMM_NR block of C
  */
-void matrix_multiply(double** A, double** B, double** C, int n)
+void gemm_kernel_generic(int kc, const double* a, const double* b, double* c, int ldc)
 {
-    for (int i = 0; i < n; i++) {
-        for (int j = 0; j < n; j++) {
-            C[i][j] = 0.0;
-            for (int k = 0; k < n; k++) {
-                C[i][j] += A[i][k] * B[k][j];
+    double acc[4][GEMM_NR] = {{0.0}};
+    for (int p = 0; p < kc; p++) {
+        for (int r = 0; r < 4; r++) {
+            for (int j = 0; j < GEMM_NR; j++) {
+                acc[r][j] += a[r] * b[j];
             }
         }
+        a += 4;
+        b += GEMM_NR;
+    }
+    for (int r = 0; r < 4; r++) {
+        for (int j = 0; j < GEMM_NR; j++) {
+            c[(size_t)r * ldc + j] += acc[r][j];
+        }
     }
 }
 
+#ifdef GEMM_X86_SIMD
 /*
- * Matrix addition: C = A + B
- * - MODERATE operation (O(n^2))
+ * AVX2 micro-kernel: 4 x 8 block of C in eight 4-wide FMA accumulators
+ */
+__attribute__((target("avx2,fma")))
+void gemm_kernel_avx2(int kc, const double* a, const double* b, double* c, int ldc)
+{
+    __m256d c00 = _mm256_setzero_pd(), c01 = _mm256_setzero_pd();
+    __m256d c10 = _mm256_setzero_pd(), c11 = _mm256_setzero_pd();
+    __m256d c20 = _mm256_setzero_pd(), c21 = _mm256_setzero_pd();
+    __m256d c30 = _mm256_setzero_pd(), c31 = _mm256_setzero_pd();
+    for (int p = 0; p < kc; p++) {
+        __m256d b0 = _mm256_load_pd(b);
+        __m256d b1 = _mm256_load_pd(b + 4);
+        __m256d a0 = _mm256_broadcast_sd(a);
+        __m256d a1 = _mm256_broadcast_sd(a + 1);
+        c00 = _mm256_fmadd_pd(a0, b0, c00);
+        c01 = _mm256_fmadd_pd(a0, b1, c01);
+        c10 = _mm256_fmadd_pd(a1, b0, c10);
+        c11 = _mm256_fmadd_pd(a1, b1, c11);
+        __m256d a2 = _mm256_broadcast_sd(a + 2);
+        __m256d a3 = _mm256_broadcast_sd(a + 3);
+        c20 = _mm256_fmadd_pd(a2, b0, c20);
+        c21 = _mm256_fmadd_pd(a2, b1, c21);
+        c30 = _mm256_fmadd_pd(a3, b0, c30);
+        c31 = _mm256_fmadd_pd(a3, b1, c31);
+        a += 4;
+        b += 8;
+    }
+    double* c0 = c;
+    double* c1 = c + ldc;
+    double* c2 = c + 2 * (size_t)ldc;
+    double* c3 = c + 3 * (size_t)ldc;
+    _mm256_storeu_pd(c0, _mm256_add_pd(_mm256_loadu_pd(c0), c00));
+    _mm256_storeu_pd(c0 + 4, _mm256_add_pd(_mm256_loadu_pd(c0 + 4), c01));
+    _mm256_storeu_pd(c1, _mm256_add_pd(_mm256_loadu_pd(c1), c10));
+    _mm256_storeu_pd(c1 + 4, _mm256_add_pd(_mm256_loadu_pd(c1 + 4), c11));
+    _mm256_storeu_pd(c2, _mm256_add_pd(_mm256_loadu_pd(c2), c20));
+    _mm256_storeu_pd(c2 + 4, _mm256_add_pd(_mm256_loadu_pd(c2 + 4), c21));
+    _mm256_storeu_pd(c3, _mm256_add_pd(_mm256_loadu_pd(c3), c30));
+    _mm256_storeu_pd(c3 + 4, _mm256_add_pd(_mm256_loadu_pd(c3 + 4), c31));
+}
+
+/*
+ * AVX-512 micro-kernel: 8 x 8 block of C in eight 8-wide FMA accumulators
  */
-void matrix_add(double** A, double** B, double** C, int n)
+__attribute__((target("avx512f")))
+void gemm_kernel_avx512(int kc, const double* a, const double* b, double* c, int ldc)
 {
-    for (int i = 0; i < n; i++) {
-        for (int j = 0; j < n; j++) {
-            C[i][j] = A[i][j] + B[i][j];
+    __m512d acc[8];
+    for (int r = 0; r < 8; r++) {
+        acc[r] = _mm512_setzero_pd();
+    }
+    for (int p = 0; p < kc; p++) {
+        __m512d bv = _mm512_load_pd(b);
+        for (int r = 0; r < 8; r++) {
+            acc[r] = _mm512_fmadd_pd(_mm512_set1_pd(a[r]), bv, acc[r]);
         }
+        a += 8;
+        b += 8;
+    }
+    for (int r = 0; r < 8; r++) {
+        double* cr = c + (size_t)r * ldc;
+        _mm512_storeu_pd(cr, _mm512_add_pd(_mm512_loadu_pd(cr), acc[r]));
     }
 }
+#endif
 
 /*
- * Matrix transpose
+ * Pick the widest micro-kernel this CPU supports
+ */
+GemmKernel gemm_select_kernel(void)
+{
+    GemmKernel kernel = {gemm_kernel_generic, 4, "generic 4x8"};
+#ifdef GEMM_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        kernel.func = gemm_kernel_avx512;
+        kernel.mr = 8;
+        kernel.name = "AVX-512 8x8";
+    } else if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        kernel.func = gemm_kernel_avx2;
+        kernel.mr = 4;
+        kernel.name = "AVX2 4x8";
+    }
+#endif
+    return kernel;
+}
+
+/*
+ * Pack the mc x kc block of A at (i0, k0) into mr-row slivers: for each
+ * sliver, the mr values of column k are consecutive, one k after another.
+ * Rows past the end of the block are zero, so edge tiles need no special case.
+ */
+void gemm_pack_a(const Matrix* A, int i0, int mc, int k0, int kc, int mr, double* packed)
+{
+    for (int ir = 0; ir < mc; ir += mr) {
+        for (int p = 0; p < kc; p++) {
+            for (int r = 0; r < mr; r++) {
+                *packed++ = (ir + r < mc) ? A->data[(size_t)(i0 + ir + r) * A->stride + k0 + p] : 0.0;
+            }
+        }
+    }
+}
+
+/*
+ * Pack the kc x nc panel of B at (k0, j0) into GEMM_NR-column slivers:
+ * for each sliver, the GEMM_NR values of row k are consecutive. Columns
+ * past the end of the panel are zero.
+ */
+void gemm_pack_b(const Matrix* B, int k0, int kc, int j0, int nc, double* packed)
+{
+    for (int jr = 0; jr < nc; jr += GEMM_NR) {
+        int nr = (nc - jr < GEMM_NR) ? nc - jr : GEMM_NR;
+        for (int p = 0; p < kc; p++) {
+            const double* b = B->data + (size_t)(k0 + p) * B->stride + j0 + jr;
+            for (int j = 0; j < nr; j++) {
+                packed[j] = b[j];
+            }
+            for (int j = nr; j < GEMM_NR; j++) {
+                packed[j] = 0.0;
+            }
+            packed += GEMM_NR;
+        }
+    }
+}
+
+/*
+ * Cache-blocked GEMM: C += A * B
+ * - Loops over NC-column panels of B and KC-deep slices of k, packing each
+ *   B panel once, then over MC-row blocks of A, packing each block once
+ * - The micro-kernel then streams the packed slivers from L1/L2 into
+ *   register tiles of C; partial tiles at the edges go through a buffer
+ */
+void gemm_blocked(const Matrix* A, const Matrix* B, Matrix* C)
+{
+    static GemmKernel kernel = {NULL, 0, NULL};
+    if (kernel.func == NULL) {
+        kernel = gemm_select_kernel();
+    }
+    const int m = C->rows, n = C->cols, k = A->cols;
+    const int mr = kernel.mr;
+    const int mc_max = (GEMM_MC + mr - 1) / mr * mr;
+    const int nc_max = (GEMM_NC + GEMM_NR - 1) / GEMM_NR * GEMM_NR;
+
+    double* packed_a = NULL;
+    double* packed_b = NULL;
+    if (posix_memalign((void**)&packed_a, MATRIX_ALIGN, (size_t)mc_max * GEMM_KC * sizeof(double)) != 0
+        || posix_memalign((void**)&packed_b, MATRIX_ALIGN, (size_t)nc_max * GEMM_KC * sizeof(double)) != 0) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+
+    for (int j0 = 0; j0 < n; j0 += GEMM_NC) {
+        int nc = (n - j0 < GEMM_NC) ? n - j0 : GEMM_NC;
+        for (int k0 = 0; k0 < k; k0 += GEMM_KC) {
+            int kc = (k - k0 < GEMM_KC) ? k - k0 : GEMM_KC;
+            gemm_pack_b(B, k0, kc, j0, nc, packed_b);
+            for (int i0 = 0; i0 < m; i0 += GEMM_MC) {
+                int mc = (m - i0 < GEMM_MC) ? m - i0 : GEMM_MC;
+                gemm_pack_a(A, i0, mc, k0, kc, mr, packed_a);
+                for (int jr = 0; jr < nc; jr += GEMM_NR) {
+                    const double* b = packed_b + (size_t)jr * kc;
+                    for (int ir = 0; ir < mc; ir += mr) {
+                        const double* a = packed_a + (size_t)ir * kc;
+                        double* c = matrix_row(C, i0 + ir) + j0 + jr;
+                        if (mc - ir >= mr && nc - jr >= GEMM_NR) {
+                            kernel.func(kc, a, b, c, C->stride);
+                        } else {
+                            /* Edge tile: compute the full tile aside, keep the part inside C */
+                            double tile[GEMM_MR_MAX * GEMM_NR] __attribute__((aligned(MATRIX_ALIGN))) = {0.0};
+                            int rows = (mc - ir < mr) ? mc - ir : mr;
+                            int cols = (nc - jr < GEMM_NR) ? nc - jr : GEMM_NR;
+                            kernel.func(kc, a, b, tile, GEMM_NR);
+                            for (int r = 0; r < rows; r++) {
+                                for (int j = 0; j < cols; j++) {
+                                    c[(size_t)r * C->stride + j] += tile[r * GEMM_NR + j];
+                                }
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    free(packed_a);
+    free(packed_b);
+}
+
+/*
+ * Add x to a compensated sum (Neumaier's variant of Kahan summation):
+ * the rounding error of every addition is kept in c and added back at the end
+ */
+static inline void compensated_add(CompensatedSum* s, double x)
+{
+    double t = s->sum + x;
+    if (fabs(s->sum) >= fabs(x)) {
+        s->c += (s->sum - t) + x;
+    } else {
+        s->c += (x - t) + s->sum;
+    }
+    s->sum = t;
+}
+
+/*
+ * Fused matrix addition and norms: C = A + B, in one pass over memory
+ * - MODERATE operation (O(n^2)), bound by memory bandwidth
+ * - Returns the sums of squares of A and of C, so the Frobenius norms of
+ *   both need no further pass: norms = matrix_add_norms(&A, &B, &C)
+ * - Each row is summed in FUSED_LANES independent partial sums (which the
+ *   compiler keeps in SIMD registers) combined pairwise; the row sums
+ *   are then added with compensated summation
+ */
+FusedNorms matrix_add_norms(const Matrix* A, const Matrix* B, Matrix* C)
+{
+    CompensatedSum sum_a = {0.0, 0.0}, sum_c = {0.0, 0.0};
+    for (int i = 0; i < C->rows; i++) {
+        const double* a = matrix_row(A, i);
+        const double* b = matrix_row(B, i);
+        double* c = matrix_row(C, i);
+        double lane_a[FUSED_LANES] = {0.0}, lane_c[FUSED_LANES] = {0.0};
+        int j = 0;
+        for (; j + FUSED_LANES <= C->cols; j += FUSED_LANES) {
+            for (int l = 0; l < FUSED_LANES; l++) {
+                double x = a[j + l];
+                double y = x + b[j + l];
+                c[j + l] = y;
+                lane_a[l] += x * x;
+                lane_c[l] += y * y;
+            }
+        }
+        for (int l = 0; j < C->cols; j++, l++) {
+            double x = a[j];
+            double y = x + b[j];
+            c[j] = y;
+            lane_a[l] += x * x;
+            lane_c[l] += y * y;
+        }
+        for (int width = FUSED_LANES / 2; width > 0; width /= 2) {
+            for (int l = 0; l < width; l++) {
+                lane_a[l] += lane_a[l + width];
+                lane_c[l] += lane_c[l + width];
+            }
+        }
+        compensated_add(&sum_a, lane_a[0]);
+        compensated_add(&sum_c, lane_c[0]);
+    }
+
+    FusedNorms norms;
+    norms.sum_sq_a = sum_a.sum + sum_a.c;
+    norms.sum_sq_c = sum_c.sum + sum_c.c;
+    return norms;
+}
+
+/*
+ * Matrix transpose: AT = A^T
  * - MODERATE operation (O(n^2))
+ * - Cache-oblivious: the recursion keeps splitting until the tiles of A
+ *   and AT fit in cache together, whatever the cache sizes are
  */
-void matrix_transpose(double** A, double** AT, int n)
+void matrix_transpose(const Matrix* A, Matrix* AT)
 {
-    for (int i = 0; i < n; i++) {
-        for (int j = 0; j < n; j++) {
-            AT[i][j] = A[j][i];
+    transpose_block(A, AT, 0, AT->rows, 0, AT->cols);
+}
+
+/*
+ * Transpose the part of AT with rows [i0, i1) and columns [j0, j1)
+ * - Halves the longer side until the block is at most TRANSPOSE_BLOCK
+ *   square, then copies it; A is read as TRANSPOSE_BLOCK-wide row pieces,
+ *   so each cache line read is used whole
+ */
+void transpose_block(const Matrix* A, Matrix* AT, int i0, int i1, int j0, int j1)
+{
+    if (i1 - i0 <= TRANSPOSE_BLOCK && j1 - j0 <= TRANSPOSE_BLOCK) {
+        for (int i = i0; i < i1; i++) {
+            double* at = matrix_row(AT, i);
+            for (int j = j0; j < j1; j++) {
+                at[j] = A->data[(size_t)j * A->stride + i];
+            }
         }
+    } else if (i1 - i0 >= j1 - j0) {
+        int mid = i0 + (i1 - i0) / 2;
+        transpose_block(A, AT, i0, mid, j0, j1);
+        transpose_block(A, AT, mid, i1, j0, j1);
+    } else {
+        int mid = j0 + (j1 - j0) / 2;
+        transpose_block(A, AT, i0, i1, j0, mid);
+        transpose_block(A, AT, i0, i1, mid, j1);
     }
 }
 
 /*
- * Compute Frobenius norm of a matrix
- * - LIGHTWEIGHT operation
+ * In-place transpose of a square matrix: A = A^T
+ * - MODERATE operation (O(n^2)), needs no second matrix
+ * - Transposes the blocks on the diagonal and swaps each block above it
+ *   with the mirrored block below, recursively as in matrix_transpose
+ */
+void matrix_transpose_inplace(Matrix* A)
+{
+    if (A->rows != A->cols) {
+        fprintf(stderr, "In-place transpose needs a square matrix\n");
+        exit(1);
+    }
+    transpose_diagonal(A, 0, A->rows);
+}
+
+/*
+ * Transpose the diagonal block with rows and columns [i0, i1) in place
  */
-double compute_frobenius_norm(double** A, int n)
+void transpose_diagonal(Matrix* A, int i0, int i1)
 {
-    double sum = 0.0;
-    for (int i = 0; i < n; i++) {
-        for (int j = 0; j < n; j++) {
-            sum += A[i][j] * A[i][j];
+    if (i1 - i0 <= TRANSPOSE_BLOCK) {
+        for (int i = i0; i < i1; i++) {
+            double* a = matrix_row(A, i);
+            for (int j = i + 1; j < i1; j++) {
+                double t = a[j];
+                a[j] = A->data[(size_t)j * A->stride + i];
+                A->data[(size_t)j * A->stride + i] = t;
+            }
+        }
+    } else {
+        int mid = i0 + (i1 - i0) / 2;
+        transpose_diagonal(A, i0, mid);
+        transpose_diagonal(A, mid, i1);
+        transpose_swap(A, i0, mid, mid, i1);
+    }
+}
+
+/*
+ * Swap A[i][j] with A[j][i] for rows [i0, i1) and columns [j0, j1),
+ * a block that lies entirely above the diagonal
+ */
+void transpose_swap(Matrix* A, int i0, int i1, int j0, int j1)
+{
+    if (i1 - i0 <= TRANSPOSE_BLOCK && j1 - j0 <= TRANSPOSE_BLOCK) {
+        for (int i = i0; i < i1; i++) {
+            double* a = matrix_row(A, i);
+            for (int j = j0; j < j1; j++) {
+                double t = a[j];
+                a[j] = A->data[(size_t)j * A->stride + i];
+                A->data[(size_t)j * A->stride + i] = t;
+            }
         }
+    } else if (i1 - i0 >= j1 - j0) {
+        int mid = i0 + (i1 - i0) / 2;
+        transpose_swap(A, i0, mid, j0, j1);
+        transpose_swap(A, mid, i1, j0, j1);
+    } else {
+        int mid = j0 + (j1 - j0) / 2;
+        transpose_swap(A, i0, i1, j0, mid);
+        transpose_swap(A, i0, i1, mid, j1);
     }
-    return sqrt(sum);
 }
 
 /*
  * Print matrix (only for small matrices)
  * - I/O intensive, not compute intensive
  */
-void print_matrix(double** matrix, int n, const char* name)
+void print_matrix(const Matrix* matrix, const char* name)
 {
-    if (n > 10) {
-        printf("%s: [%d x %d matrix - too large to display]\n", name, n, n);
+    if (matrix->rows > 10 || matrix->cols > 10) {
+        printf("%s: [%d x %d matrix - too large to display]\n", name, matrix->rows, matrix->cols);
         return;
     }
 
     printf("%s:\n", name);
-    for (int i = 0; i < n; i++) {
-        for (int j = 0; j < n; j++) {
-            printf("%8.4f ", matrix[i][j]);
+    for (int i = 0; i < matrix->rows; i++) {
+        const double* row = matrix_row(matrix, i);
+        for (int j = 0; j < matrix->cols; j++) {
+            printf("%8.4f ", row[j]);
         }
         printf("\n");
     }
@@ -194,37 +638,40 @@ int main(int argc, char* argv[])
 
     printf("=== gprof Serial Example ===\n");
     printf("Matrix size: %d x %d\n", n, n);
+#ifdef USE_CBLAS
+    printf("GEMM: BLAS dgemm\n");
+#else
+    printf("GEMM: blocked, %s kernel, MC=%d KC=%d NC=%d\n", gemm_select_kernel().name, GEMM_MC, GEMM_KC, GEMM_NC);
+#endif
     printf("This will take a few seconds to generate profile data...\n\n");
 
     /* Allocate matrices */
-    double** A = allocate_matrix(n);
-    double** B = allocate_matrix(n);
-    double** C = allocate_matrix(n);
-    double** D = allocate_matrix(n);
-    double** AT = allocate_matrix(n);
+    Matrix A = allocate_matrix(n);
+    Matrix B = allocate_matrix(n);
+    Matrix C = allocate_matrix(n);
+    Matrix D = allocate_matrix(n);
 
     /* Initialize matrices */
     printf("Initializing matrices...\n");
-    initialize_matrix(A, n, 1.0);
-    initialize_matrix(B, n, 2.0);
-    initialize_matrix(C, n, 0.0);
-    initialize_matrix(D, n, 0.0);
-    initialize_matrix(AT, n, 0.0);
+    initialize_matrix(&A, 1.0);
+    initialize_matrix(&B, 2.0);
+    initialize_matrix(&C, 0.0);
+    initialize_matrix(&D, 0.0);
 
     /* Perform matrix operations */
     printf("Computing C = A * B (this is the HOTSPOT)...\n");
-    matrix_multiply(A, B, C, n);
+    matrix_multiply(&A, &B, &C);
 
-    printf("Computing D = C + A...\n");
-    matrix_add(C, A, D, n);
+    /* The norms of C and D are gathered while D is computed, in the same pass */
+    printf("Computing D = C + A and the Frobenius norms...\n");
+    FusedNorms norms = matrix_add_norms(&C, &A, &D);
 
-    printf("Computing transpose of A...\n");
-    matrix_transpose(A, AT, n);
+    /* A is not needed any more, so it is transposed in place instead of into a copy */
+    printf("Computing transpose of A (in place)...\n");
+    matrix_transpose_inplace(&A);
 
-    /* Compute norms */
-    printf("Computing Frobenius norms...\n");
-    double norm_C = compute_frobenius_norm(C, n);
-    double norm_D = compute_frobenius_norm(D, n);
+    double norm_C = sqrt(norms.sum_sq_a);
+    double norm_D = sqrt(norms.sum_sq_c);
     printf("||C||_F = %.4f\n", norm_C);
     printf("||D||_F = %.4f\n", norm_D);
 
@@ -240,16 +687,15 @@ int main(int argc, char* argv[])
 
     /* Print small matrices */
     if (n <= 10) {
-        print_matrix(A, n, "A");
-        print_matrix(C, n, "C = A * B");
+        print_matrix(&A, "A^T");
+        print_matrix(&C, "C = A * B");
     }
 
     /* Clean up */
-    free_matrix(A, n);
-    free_matrix(B, n);
-    free_matrix(C, n);
-    free_matrix(D, n);
-    free_matrix(AT, n);
+    free_matrix(&A);
+    free_matrix(&B);
+    free_matrix(&C);
+    free_matrix(&D);
 
     printf("\n=== Profiling complete ===\n");
     printf("Analyze with: gprof serial_example gmon.out\n");